@@ -0,0 +1,21 @@
+#pragma once
+
+#include <eosio/asset.hpp>
+#include <eosio/eosio.hpp>
+#include <eosio/name.hpp>
+
+using eosio::action_wrapper;
+using eosio::asset;
+using eosio::name;
+
+class [[eosio::contract("exchange.results")]] exchange_results : eosio::contract {
+   public:
+
+      using eosio::contract::contract;
+
+      [[eosio::action]]
+      void fill( uint64_t market, const name& maker, const name& taker, const asset& price, const asset& volume,
+                 uint64_t maker_order_id, uint64_t taker_order_id );
+
+      using fill_action = action_wrapper<"fill"_n, &exchange_results::fill>;
+};
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+
+#ifdef __wasm__
+#include <eosio/check.hpp>
+#else
+#include <stdexcept>
+#endif
+
+namespace eosio {
+
+   /**
+    *  Exact limit price: `base` units of the base asset for `quote` units of the quote
+    *  asset, both raw amounts. Prices are compared and applied to volumes by
+    *  cross-multiplying in 128 bits, so matching never needs floating point.
+    *
+    *  Every price on a market is quoted per whole quote unit (`quote` is 10^precision
+    *  of the quote symbol), which makes `base` alone an exact book key. Shared by the
+    *  contract tables and the matching core below.
+    */
+   struct order_price {
+      uint64_t   base;
+      uint64_t   quote;
+
+      friend bool operator<( const order_price& a, const order_price& b ) {
+         return (unsigned __int128)a.base * b.quote < (unsigned __int128)b.base * a.quote;
+      }
+      friend bool operator<=( const order_price& a, const order_price& b ) { return !(b < a); }
+      friend bool operator>=( const order_price& a, const order_price& b ) { return !(a < b); }
+   };
+
+namespace matching {
+
+   using uint128_t = unsigned __int128;
+
+#ifndef __wasm__
+   /**
+    *  Native builds report failed checks as exceptions where the contract aborts the action.
+    */
+   inline void check( bool pred, const char* msg ) {
+      if( !pred )
+         throw std::runtime_error( msg );
+   }
+#endif
+
+   /**
+    *  Largest amount an asset can hold, the same as `asset::max_amount`.
+    */
+   static constexpr int64_t max_amount = (1LL << 62) - 1;
+
+   /**
+    *  What happens to the part of an order that does not fill right away: it rests on
+    *  the book (`good_till_cancel`), is refunded (`immediate_or_cancel`), fails the
+    *  whole order unless a dry run fills it in full (`fill_or_kill`), or the order
+    *  fails if it would cross the book at all (`post_only`).
+    */
+   enum class time_in_force : uint8_t {
+      good_till_cancel,
+      immediate_or_cancel,
+      fill_or_kill,
+      post_only
+   };
+
+   /**
+    *  Amount of base asset owed for `quote_amount` of quote asset at `price`, rounded up.
+    */
+   inline int64_t base_value( const order_price& price, int64_t quote_amount ) {
+      const uint128_t value = (uint128_t(price.base) * uint128_t(quote_amount) + price.quote - 1) / price.quote;
+      check( value <= uint128_t(max_amount), "order value overflow" );
+      return int64_t(value);
+   }
+
+   /**
+    *  Base amount moving on a fill of `traded` against the resting order `maker`.
+    *  Computed as the difference of the rounded values before and after the fill so
+    *  that a bid's locked base drains exactly to zero.
+    */
+   template<typename Order>
+   int64_t fill_value( const Order& maker, int64_t traded ) {
+      return base_value( maker.price, maker.volume.amount )
+           - base_value( maker.price, maker.volume.amount - traded );
+   }
+
+   /**
+    *  Fee of `bps` basis points on `amount`, rounded down.
+    */
+   inline int64_t fee_amount( int64_t amount, uint16_t bps ) {
+      return int64_t( uint128_t(amount) * bps / 10000 );
+   }
+
+   template<typename Cursor, typename Order>
+   bool crosses( bool taker_bids, const Cursor& taker, const Order& maker ) {
+      return taker_bids ? maker.price <= taker.price : maker.price >= taker.price;
+   }
+
+   /**
+    *  The matching core of the exchange, shared by the contract and native host code.
+    *  Every function works on one market through a storage policy `Storage`, which the
+    *  contract implements with multi_index tables and native code with STL containers.
+    *
+    *  Orders and cursors expose `id`, `trader`, `price` (an `order_price`), `volume.amount`
+    *  and `expiration`; cursors also carry `locked.amount`, the funds held for them. A
+    *  storage policy provides:
+    *
+    *    bool is_bid( const cursor& )                       side of an incoming order
+    *    bool is_expired( expiration )                      against the current time
+    *    uint16_t maker_fee(), taker_fee()                  in basis points
+    *
+    *    const order* best_order( bool bids )               first in price-time priority
+    *    void walk_book( bool bids, F f )                   priority order while `f` returns true
+    *    const order* find_order( bool bids, uint64_t id )
+    *    const order* first_to_expire( bool bids )          earliest expiration
+    *    const order* first_of_trader( bool bids, trader )
+    *    void insert_order( const cursor& )                 rest on the cursor's own side
+    *    void reduce_order( bool bids, const order&, int64_t traded )
+    *    void erase_order( bool bids, const order& )
+    *
+    *    const cursor* first_parked()                       oldest unfinished order
+    *    const cursor* find_parked( uint64_t id )
+    *    const cursor* first_parked_of_trader( trader )
+    *    void park( const cursor& ), update_parked( const cursor& ), unpark( const cursor& )
+    *
+    *    void credit( trader, bool base, int64_t amount )   balance change in base or quote
+    *    void accrue_fee( bool base, int64_t amount )
+    *    void adjust_level( bool bids, const order_price&, int64_t volume, int32_t orders )
+    *    void record_fill( const order& maker, const cursor& taker, int64_t traded, int64_t value )
+    *
+    *  Order pointers stay valid until the order is erased or reduced. Every walk that
+    *  removes orders reads the front of the book again after each removal, so a policy
+    *  never has to keep iterators alive across writes.
+    */
+
+   /**
+    *  Takes `o` off the book and returns the funds it has locked to its trader: base
+    *  tokens for a bid, quote tokens for an ask.
+    */
+   template<typename Storage, typename Order>
+   void release_order( Storage& s, bool bids, const Order& o ) {
+      s.credit( o.trader, bids, bids ? base_value( o.price, o.volume.amount ) : o.volume.amount );
+      s.adjust_level( bids, o.price, -o.volume.amount, -1 );
+      s.erase_order( bids, o );
+   }
+
+   /**
+    *  Fills `taker` against the opposite side of the book with at most `max` fills.
+    *  Expired makers met on the way are removed at the cost of one fill. The taker's
+    *  proceeds and the fees are netted over the whole sweep and settled once.
+    *
+    *  A bidding taker locked the rounded up value of its whole volume once, so fills
+    *  against asks are settled against that lock: a fill whose own rounding would eat
+    *  into what the remainder needs pays the ask one unit less.
+    */
+   template<typename Storage, typename Cursor>
+   uint16_t match_taker( Storage& s, Cursor& taker, uint16_t max ) {
+      // a bidding taker receives quote and pays base, an asking taker the other way round
+      const bool taker_bids = s.is_bid( taker );
+      const bool maker_bids = !taker_bids;
+
+      int64_t taker_proceeds = 0;
+      int64_t taker_fees     = 0;
+      int64_t maker_fees     = 0;
+
+      uint16_t fills = 0;
+      for( ; taker.volume.amount > 0 && fills < max; ++fills ) {
+         const auto* maker = s.best_order( maker_bids );
+         if( maker == nullptr || !crosses( taker_bids, taker, *maker ) )
+            break;
+
+         // stale liquidity is removed where the walk meets it, at the cost of one fill
+         if( s.is_expired( maker->expiration ) ) {
+            release_order( s, maker_bids, *maker );
+            continue;
+         }
+
+         const int64_t traded = std::min( taker.volume.amount, maker->volume.amount );
+         int64_t value = fill_value( *maker, traded );
+         if( taker_bids ) {
+            // each fill rounds up on its own, so a bidding taker pays at most what its
+            // lock holds beyond the rounded value of the volume still to fill
+            value = std::min( value, taker.locked.amount - base_value( taker.price, taker.volume.amount - traded ) );
+         }
+
+         // the maker's locked funds go to the taker, the taker's locked funds to the maker
+         const int64_t taker_amount = taker_bids ? traded : value;
+         const int64_t maker_amount = taker_bids ? value : traded;
+         const int64_t taker_fee    = fee_amount( taker_amount, s.taker_fee() );
+         const int64_t maker_fee    = fee_amount( maker_amount, s.maker_fee() );
+
+         taker.locked.amount -= maker_amount;
+         taker_proceeds      += taker_amount - taker_fee;
+         taker_fees          += taker_fee;
+         maker_fees          += maker_fee;
+         s.credit( maker->trader, taker_bids, maker_amount - maker_fee );
+         check( taker.locked.amount >= 0, "taker locked balance overdrawn" );
+         taker.volume.amount -= traded;
+
+         s.record_fill( *maker, taker, traded, value );
+
+         const bool filled = traded == maker->volume.amount;
+         s.adjust_level( maker_bids, maker->price, -traded, filled ? -1 : 0 );
+         if( filled ) {
+            s.erase_order( maker_bids, *maker );
+         } else {
+            s.reduce_order( maker_bids, *maker, traded );
+         }
+      }
+
+      if( taker_proceeds != 0 )
+         s.credit( taker.trader, maker_bids, taker_proceeds );
+      s.accrue_fee( maker_bids, taker_fees );
+      s.accrue_fee( taker_bids, maker_fees );
+      return fills;
+   }
+
+   template<typename Storage, typename Cursor>
+   bool has_cross( Storage& s, const Cursor& taker ) {
+      const bool taker_bids = s.is_bid( taker );
+      const auto* best = s.best_order( !taker_bids );
+      return best != nullptr && crosses( taker_bids, taker, *best );
+   }
+
+   /**
+    *  Quote volume `taker` would fill within `max` steps of the matching walk, without
+    *  writing anything. Expired orders cost a step and fill nothing, just as in
+    *  `match_taker`. The walk stops once `wanted` volume is found.
+    */
+   template<typename Storage, typename Cursor>
+   int64_t fillable_volume( Storage& s, const Cursor& taker, uint16_t max, int64_t wanted ) {
+      const bool taker_bids = s.is_bid( taker );
+
+      int64_t volume = 0;
+      uint16_t steps = 0;
+      s.walk_book( !taker_bids, [&]( const auto& o ) {
+         if( volume >= wanted || steps >= max || !crosses( taker_bids, taker, o ) )
+            return false;
+         if( !s.is_expired( o.expiration ) )
+            volume += o.volume.amount;
+         ++steps;
+         return true;
+      });
+      return volume;
+   }
+
+   /**
+    *  Places what is left of a fully matched taker on its own side of the book and
+    *  returns any funds locked beyond what the resting order needs.
+    */
+   template<typename Storage, typename Cursor>
+   void rest_or_refund( Storage& s, Cursor& taker ) {
+      const bool bids = s.is_bid( taker );
+      int64_t still_locked = 0;
+
+      if( taker.volume.amount > 0 ) {
+         s.insert_order( taker );
+         s.adjust_level( bids, taker.price, taker.volume.amount, 1 );
+         still_locked = bids ? base_value( taker.price, taker.volume.amount ) : taker.volume.amount;
+      }
+
+      const int64_t refund = taker.locked.amount - still_locked;
+      if( refund != 0 )
+         s.credit( taker.trader, bids, refund );
+      taker.locked.amount = still_locked;
+   }
+
+   /**
+    *  Removes the parked order `c` and returns all the funds it has locked to its trader.
+    */
+   template<typename Storage, typename Cursor>
+   void release_cursor( Storage& s, const Cursor& c ) {
+      auto taker = c;
+      taker.volume.amount = 0;
+      rest_or_refund( s, taker );
+      s.unpark( taker );
+   }
+
+   /**
+    *  Works through the parked orders of a market oldest first, spending at most
+    *  `max` fills. Returns the number of fills spent.
+    */
+   template<typename Storage>
+   uint16_t resume_cursors( Storage& s, uint16_t max ) {
+      uint16_t fills = 0;
+      while( fills < max ) {
+         const auto* parked = s.first_parked();
+         if( parked == nullptr )
+            break;
+
+         if( s.is_expired( parked->expiration ) ) {
+            // an expired remainder is refunded instead of matched
+            release_cursor( s, *parked );
+            ++fills;
+            continue;
+         }
+
+         auto taker = *parked;
+         fills += match_taker( s, taker, max - fills );
+
+         if( taker.volume.amount > 0 && has_cross( s, taker ) ) {
+            s.update_parked( taker );
+            break;
+         }
+         rest_or_refund( s, taker );
+         s.unpark( taker );
+      }
+      return fills;
+   }
+
+   /**
+    *  Matches a new order whose funds are already locked in `taker.locked`. Orders
+    *  parked earlier keep their priority and are resumed first; while any of them is
+    *  left, a new order that crosses the book waits behind them and one that does not
+    *  is placed on the book right away. A remainder that still crosses the book is
+    *  parked and the rest of the order is placed on the book or refunded according
+    *  to `tif`.
+    */
+   template<typename Storage, typename Cursor>
+   void place_order( Storage& s, Cursor& taker, uint16_t max_fills, time_in_force tif ) {
+      if( tif == time_in_force::fill_or_kill ) {
+         // dry run over the book as it stands, before any row is written
+         check( s.first_parked() == nullptr
+                && fillable_volume( s, taker, max_fills, taker.volume.amount ) >= taker.volume.amount,
+                "fill-or-kill order cannot be filled in full" );
+      }
+
+      // earlier orders still waiting in a cursor keep their priority over this one
+      const uint16_t fills = resume_cursors( s, max_fills );
+
+      if( tif == time_in_force::post_only ) {
+         check( fillable_volume( s, taker, std::numeric_limits<uint16_t>::max(), 1 ) == 0,
+                "post-only order would cross the book" );
+         rest_or_refund( s, taker );
+         return;
+      }
+
+      const bool never_rests = tif == time_in_force::immediate_or_cancel || tif == time_in_force::fill_or_kill;
+      if( s.first_parked() != nullptr && has_cross( s, taker ) ) {
+         if( never_rests ) {
+            taker.volume.amount = 0;
+            rest_or_refund( s, taker );
+         } else {
+            s.park( taker );
+         }
+         return;
+      }
+
+      match_taker( s, taker, max_fills - fills );
+      if( never_rests ) {
+         check( tif != time_in_force::fill_or_kill || taker.volume.amount == 0, "fill-or-kill order cannot be filled in full" );
+         taker.volume.amount = 0;
+         rest_or_refund( s, taker );
+         return;
+      }
+      if( taker.volume.amount > 0 && has_cross( s, taker ) ) {
+         s.park( taker );
+         return;
+      }
+      rest_or_refund( s, taker );
+   }
+
+   /**
+    *  Removes the order `id` of `trader`, resting on the book or parked in a cursor,
+    *  and releases its locked funds.
+    */
+   template<typename Storage, typename Trader>
+   void cancel_order( Storage& s, const Trader& trader, bool bids, uint64_t id ) {
+      if( const auto* o = s.find_order( bids, id ) ) {
+         check( o->trader == trader, "order belongs to another trader" );
+         release_order( s, bids, *o );
+         return;
+      }
+
+      const auto* parked = s.find_parked( id );
+      check( parked != nullptr && s.is_bid( *parked ) == bids, "order does not exist" );
+      check( parked->trader == trader, "order belongs to another trader" );
+      release_cursor( s, *parked );
+   }
+
+   /**
+    *  Removes at most `max` expired orders, earliest expiration first, bids and then
+    *  asks. Returns the number removed.
+    */
+   template<typename Storage>
+   uint16_t expire_orders( Storage& s, uint16_t max ) {
+      uint16_t expired = 0;
+      for( bool bids : { true, false } ) {
+         for( ; expired < max; ++expired ) {
+            const auto* o = s.first_to_expire( bids );
+            if( o == nullptr || !s.is_expired( o->expiration ) )
+               break;
+            release_order( s, bids, *o );
+         }
+      }
+      return expired;
+   }
+
+   /**
+    *  Cancels at most `max` orders of `trader`, bids first, then asks and then parked
+    *  orders, and credits the released funds of resting orders once per token. Returns
+    *  the number cancelled.
+    */
+   template<typename Storage, typename Trader>
+   uint16_t cancel_trader_orders( Storage& s, const Trader& trader, uint16_t max ) {
+      uint16_t cancelled = 0;
+      for( bool bids : { true, false } ) {
+         int64_t released = 0;
+         for( ; cancelled < max; ++cancelled ) {
+            const auto* o = s.first_of_trader( bids, trader );
+            if( o == nullptr )
+               break;
+            released += bids ? base_value( o->price, o->volume.amount ) : o->volume.amount;
+            s.adjust_level( bids, o->price, -o->volume.amount, -1 );
+            s.erase_order( bids, *o );
+         }
+         if( released > 0 )
+            s.credit( trader, bids, released );
+      }
+      for( ; cancelled < max; ++cancelled ) {
+         const auto* parked = s.first_parked_of_trader( trader );
+         if( parked == nullptr )
+            break;
+         release_cursor( s, *parked );
+      }
+      return cancelled;
+   }
+
+} } // namespace eosio::matching
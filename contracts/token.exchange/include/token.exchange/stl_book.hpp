@@ -0,0 +1,275 @@
+#pragma once
+
+#include <token.exchange/matching.hpp>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace eosio { namespace matching {
+
+   /**
+    *  Raw amount standing in for `asset` in native orders.
+    */
+   struct native_quantity {
+      int64_t   amount = 0;
+   };
+
+   /**
+    *  A resting order of `stl_book`. Traders are plain 64-bit ids and a zero
+    *  `expiration` (seconds) means good until cancelled, as in the contract.
+    */
+   struct native_order {
+      uint64_t          id = 0;
+      uint64_t          trader = 0;
+      order_price       price{ 0, 1 };
+      native_quantity   volume;
+      uint32_t          expiration = 0;
+   };
+
+   /**
+    *  An incoming order of `stl_book` while it is matched or parked.
+    */
+   struct native_cursor {
+      uint64_t          id = 0;
+      uint64_t          trader = 0;
+      bool              bid = false;
+      order_price       price{ 0, 1 };
+      native_quantity   volume;
+      native_quantity   locked;
+      uint32_t          expiration = 0;
+   };
+
+   /**
+    *  Storage policy of the matching core built on STL containers, for running and
+    *  measuring the exchange's matching logic natively. One `stl_book` is one market;
+    *  balances are kept per (trader, base or quote) and every write takes effect at
+    *  once instead of at the end of an action.
+    *
+    *  Like the contract, orders are keyed by `price.base` only, so every price of a
+    *  book must share the same `quote`.
+    */
+   class stl_book {
+      public:
+         struct fill {
+            uint64_t      maker;
+            uint64_t      taker;
+            order_price   price;
+            int64_t       volume;
+            int64_t       value;
+            uint64_t      maker_order_id;
+            uint64_t      taker_order_id;
+         };
+
+         struct level {
+            int64_t    volume = 0;
+            int32_t    orders = 0;
+         };
+
+         uint16_t   maker_fee_bps = 0;
+         uint16_t   taker_fee_bps = 0;
+         uint32_t   now = 0;
+         /**
+          *  Fills are counted always and kept in `fills` only when `keep_fills` is set
+          */
+         bool                                         keep_fills = true;
+         uint64_t                                     fill_count = 0;
+         std::vector<fill>                            fills;
+         /**
+          *  Fees collected, in quote (index 0) and base (index 1)
+          */
+         int64_t                                      fees[2] = { 0, 0 };
+         std::map<std::pair<uint64_t, bool>, int64_t> balances;
+         /**
+          *  Aggregated depth by (bids, level key), best level first on each side
+          */
+         std::map<std::pair<bool, uint64_t>, level>   levels;
+
+         int64_t balance( uint64_t trader, bool base ) const {
+            auto itr = balances.find( { trader, base } );
+            return itr != balances.end() ? itr->second : 0;
+         }
+
+         /**
+          *  Locks the funds of a new order of `trader`, as the contract's `trade` does,
+          *  and matches it. Returns the order id. There are no transactions here: when a
+          *  check fails only the order's own locked funds are given back.
+          */
+         uint64_t place( uint64_t trader, bool bid, order_price price, int64_t volume, uint16_t max_fills,
+                         time_in_force tif = time_in_force::good_till_cancel, uint32_t expiration = 0 ) {
+            check( price.base > 0 && price.quote > 0, "invalid price" );
+            check( volume > 0, "invalid volume" );
+            check( !is_expired( expiration ), "order expiration must be in the future" );
+
+            native_cursor taker;
+            taker.id            = _next_order_id++;
+            taker.trader        = trader;
+            taker.bid           = bid;
+            taker.price         = price;
+            taker.volume.amount = volume;
+            taker.locked.amount = bid ? base_value( price, volume ) : volume;
+            taker.expiration    = expiration;
+
+            int64_t& funds = balances[{ trader, bid }];
+            check( funds >= taker.locked.amount, "overdrawn balance" );
+            funds -= taker.locked.amount;
+
+            try {
+               place_order( *this, taker, max_fills, tif );
+            } catch( ... ) {
+               balances[{ trader, bid }] += taker.locked.amount;
+               throw;
+            }
+            return taker.id;
+         }
+
+         size_t order_count( bool bids ) const { return side( bids ).size(); }
+         size_t parked_count() const { return _parked.size(); }
+
+         // storage policy of the matching core
+
+         bool is_bid( const native_cursor& c ) const { return c.bid; }
+         bool is_expired( uint32_t expiration ) const { return expiration != 0 && expiration <= now; }
+         uint16_t maker_fee() const { return maker_fee_bps; }
+         uint16_t taker_fee() const { return taker_fee_bps; }
+
+         const native_order* best_order( bool bids ) const {
+            const auto& orders = side( bids );
+            return orders.empty() ? nullptr : &orders.begin()->second;
+         }
+
+         template<typename F>
+         void walk_book( bool bids, F f ) const {
+            for( const auto& o : side( bids ) ) {
+               if( !f( o.second ) )
+                  break;
+            }
+         }
+
+         const native_order* find_order( bool bids, uint64_t id ) const {
+            auto itr = _by_id.find( id );
+            return itr != _by_id.end() && itr->second.first == bids ? itr->second.second : nullptr;
+         }
+
+         const native_order* first_to_expire( bool bids ) const {
+            const auto& index = _by_expiry[bids];
+            return index.empty() ? nullptr : _by_id.at( index.begin()->second ).second;
+         }
+
+         const native_order* first_of_trader( bool bids, uint64_t trader ) const {
+            const auto& index = _by_trader[bids];
+            auto itr = index.lower_bound( { trader, 0 } );
+            return itr != index.end() && itr->first == trader ? _by_id.at( itr->second ).second : nullptr;
+         }
+
+         void insert_order( const native_cursor& taker ) {
+            native_order o;
+            o.id         = taker.id;
+            o.trader     = taker.trader;
+            o.price      = taker.price;
+            o.volume     = taker.volume;
+            o.expiration = taker.expiration;
+
+            auto& row = side( taker.bid ).emplace( book_key( taker.bid, o ), o ).first->second;
+            _by_id.emplace( o.id, std::make_pair( taker.bid, &row ) );
+            _by_expiry[taker.bid].emplace( expiry_key( o.expiration ), o.id );
+            _by_trader[taker.bid].emplace( o.trader, o.id );
+         }
+
+         void reduce_order( bool, const native_order& o, int64_t traded ) {
+            const_cast<native_order&>( o ).volume.amount -= traded;
+         }
+
+         void erase_order( bool bids, const native_order& o ) {
+            _by_expiry[bids].erase( { expiry_key( o.expiration ), o.id } );
+            _by_trader[bids].erase( { o.trader, o.id } );
+            _by_id.erase( o.id );
+            side( bids ).erase( book_key( bids, o ) );
+         }
+
+         const native_cursor* first_parked() const {
+            return _parked.empty() ? nullptr : &_parked.front();
+         }
+
+         const native_cursor* find_parked( uint64_t id ) const {
+            for( const auto& c : _parked ) {
+               if( c.id == id )
+                  return &c;
+            }
+            return nullptr;
+         }
+
+         const native_cursor* first_parked_of_trader( uint64_t trader ) const {
+            for( const auto& c : _parked ) {
+               if( c.trader == trader )
+                  return &c;
+            }
+            return nullptr;
+         }
+
+         void park( const native_cursor& taker ) { _parked.push_back( taker ); }
+
+         void update_parked( const native_cursor& taker ) {
+            for( auto& c : _parked ) {
+               if( c.id == taker.id ) {
+                  c = taker;
+                  return;
+               }
+            }
+         }
+
+         void unpark( const native_cursor& taker ) {
+            for( auto itr = _parked.begin(); itr != _parked.end(); ++itr ) {
+               if( itr->id == taker.id ) {
+                  _parked.erase( itr );
+                  return;
+               }
+            }
+         }
+
+         void credit( uint64_t trader, bool base, int64_t amount ) { balances[{ trader, base }] += amount; }
+         void accrue_fee( bool base, int64_t amount ) { fees[base] += amount; }
+
+         void adjust_level( bool bids, const order_price& price, int64_t volume, int32_t orders ) {
+            const auto key = std::make_pair( bids, bids ? std::numeric_limits<uint64_t>::max() - price.base : price.base );
+            auto& l = levels[key];
+            l.volume += volume;
+            l.orders += orders;
+            if( l.orders == 0 ) {
+               check( l.volume == 0, "price level volume mismatch" );
+               levels.erase( key );
+            }
+         }
+
+         void record_fill( const native_order& maker, const native_cursor& taker, int64_t traded, int64_t value ) {
+            ++fill_count;
+            if( keep_fills )
+               fills.push_back( { maker.trader, taker.trader, maker.price, traded, value, maker.id, taker.id } );
+         }
+
+      private:
+         using orders = std::map<uint128_t, native_order>;
+
+         static uint128_t book_key( bool bids, const native_order& o ) {
+            const uint64_t price = bids ? std::numeric_limits<uint64_t>::max() - o.price.base : o.price.base;
+            return (uint128_t(price) << 64) | o.id;
+         }
+
+         static uint64_t expiry_key( uint32_t expiration ) {
+            return expiration == 0 ? std::numeric_limits<uint64_t>::max() : expiration;
+         }
+
+         orders& side( bool bids ) { return bids ? _bids : _asks; }
+         const orders& side( bool bids ) const { return bids ? _bids : _asks; }
+
+         orders                                                          _asks;
+         orders                                                          _bids;
+         std::unordered_map<uint64_t, std::pair<bool, native_order*>>    _by_id;
+         std::set<std::pair<uint64_t, uint64_t>>                         _by_expiry[2];
+         std::set<std::pair<uint64_t, uint64_t>>                         _by_trader[2];
+         std::deque<native_cursor>                                       _parked;
+         uint64_t                                                        _next_order_id = 1;
+   };
+
+} } // namespace eosio::matching
@@ -1,5 +1,10 @@
 #include <eosio.token/eosio.token.hpp>
-#include <cmath>
+#include <token.exchange/exchange.results.hpp>
+#include <token.exchange/matching.hpp>
+#include <eosio/singleton.hpp>
+#include <eosio/time.hpp>
+#include <optional>
+#include <string_view>
 
 #define CONTRACT_ACCOUNT "exchange"_n
 
@@ -34,11 +39,9 @@ namespace eosio {
    private:
 
    /**
-    *  Each user has their own account with the exchange contract that keeps track
-    *  of how much a user has on deposit for each extended asset type. The assumption
-    *  is that storing a single flat map of all balances for a particular user will
-    *  be more practical than breaking this down into a multi-index table sorted by
-    *  the extended_symbol.  
+    *  Legacy layout of user balances: one row per user holding a map of every token
+    *  the user has on deposit. Kept only so `migrate` can move old rows over to
+    *  `exbalances`.
     */
    struct [[eosio::table]] exaccount {
       name                                 owner;
@@ -50,83 +53,1024 @@ namespace eosio {
    typedef eosio::multi_index<"exaccounts"_n, exaccount> exaccounts;
 
 
+   static constexpr uint128_t token_key( const extended_symbol& sym ) {
+      return (uint128_t(sym.get_contract().value) << 64) | sym.get_symbol().raw();
+   }
+
    /**
-    *  Provides an abstracted interface around storing balances for users. This class
-    *  caches tables to make multiple accesses effecient.
+    *  Each user has their own account with the exchange contract that keeps track
+    *  of how much a user has on deposit for each extended asset type. Balances are
+    *  stored one row per token in a table scoped by the owner and looked up through
+    *  the `bytoken` index on (contract, symbol), so adjusting one balance never
+    *  touches the user's other balances.
     */
-   // struct exchange_accounts {
-   //    exchange_accounts( name code ) : _self( code ){}
+   struct [[eosio::table]] exbalance {
+      uint64_t         id;
+      extended_asset   balance;
 
-   //    void adjust_balance( name owner, extended_asset delta ) {
+      uint64_t  primary_key() const { return id; }
+      uint128_t by_token() const { return token_key( balance.get_extended_symbol() ); }
+   };
 
-   //       auto table = exaccounts_cache.find( owner );
-   //       if( table == exaccounts_cache.end() ) {
-   //          table = exaccounts_cache.emplace( _self, exaccounts( _self, owner.value )  ).first;
-   //       }
+   typedef eosio::multi_index<"exbalances"_n, exbalance,
+                              indexed_by<"bytoken"_n, const_mem_fun<exbalance, uint128_t, &exbalance::by_token>>
+                             > exbalances;
 
-   //       auto useraccounts = table->second.find( owner.value );
-   //       if( useraccounts == table->second.end() ) {
-   //          table->second.emplace( _self, [&]( auto& exa ){
-   //            exa.owner = owner;
-   //            exa.balances[delta.get_extended_symbol()] = delta.quantity.amount;
-   //            check( delta.quantity.amount >= 0, "overdrawn balance 1" );
-   //          });
-   //       } else {
-   //          table->second.modify( useraccounts, same_payer, [&]( auto& exa ) {
-   //            const auto& b = exa.balances[delta.get_extended_symbol()] += delta.quantity.amount;
-   //            check( b >= 0, "overdrawn balance 2" );
-   //          });
-   //       }
 
-   //    }
+   /**
+    *  Token contracts approved by the exchange account. Transfers notified by any
+    *  other contract are rejected, so balances only ever hold approved tokens.
+    */
+   struct [[eosio::table]] token_contract {
+      name   contract;
 
-   //    private: 
-   //       name _self;
-   //       /**
-   //        *  Keep a cache of all accounts tables we access
-   //        */
-   //       std::map<name, exaccounts> exaccounts_cache;
-   // };
+      uint64_t primary_key() const { return contract.value; }
+   };
 
+   typedef eosio::multi_index<"tokens"_n, token_contract> token_contracts;
 
-   void _adjust_balance( name owner, extended_asset delta ) {
-      exaccounts _exaccounts_table(get_self(), owner.value);
 
-      auto useraccounts = _exaccounts_table.find( owner.value );
-      if( useraccounts == _exaccounts_table.end() ) {
-         _exaccounts_table.emplace( get_self(), [&]( auto& exa ){
-            exa.owner = owner;
-            exa.balances[delta.get_extended_symbol()] = delta.quantity.amount;
-            check( delta.quantity.amount >= 0, "overdrawn balance 1" );
-         });
-      } else {
-         _exaccounts_table.modify( useraccounts, same_payer, [&]( auto& exa ) {
-            const auto& b = exa.balances[delta.get_extended_symbol()] += delta.quantity.amount;
-            check( b >= 0, "overdrawn balance 2" );
+   /**
+    *  Packs a price and an insertion sequence into a single 128-bit book key. The
+    *  price occupies the high 64 bits and the sequence the low 64 bits, so ordering
+    *  by key is price priority first and time priority second.
+    */
+   static constexpr uint128_t make_book_key( uint64_t price, uint64_t sequence ) {
+      return (uint128_t(price) << 64) | sequence;
+   }
+
+   /**
+    *  Converts an action price (base asset paid for one whole quote unit) to an `order_price`.
+    */
+   static order_price to_order_price( const asset& price, const symbol& quote_sym ) {
+      uint64_t whole_unit = 1;
+      for( uint8_t i = 0; i < quote_sym.precision(); ++i )
+         whole_unit *= 10;
+      return order_price{ uint64_t(price.amount), whole_unit };
+   }
+
+   /**
+    *  A resting limit order. Asks and bids share this layout but live in separate
+    *  tables scoped by market. The order id doubles as its insertion sequence.
+    *
+    *  `price` is the amount of the base asset paid per whole unit of the quote asset
+    *  and `volume` is the quote amount still open on the book. An order with a zero
+    *  `expiration` is good until cancelled.
+    */
+   struct [[eosio::table]] order {
+      uint64_t         id;
+      name             trader;
+      order_price      price;
+      asset            volume;
+      time_point_sec   timestamp;
+      time_point_sec   expiration;
+
+      uint64_t  primary_key() const { return id; }
+
+      /**
+       *  Lowest price first, earliest order first within a price level.
+       */
+      uint128_t by_ask() const { return make_book_key( price.base, id ); }
+
+      /**
+       *  Highest price first, earliest order first within a price level. The price
+       *  is inverted so that `begin()` of the index is the best bid.
+       */
+      uint128_t by_bid() const { return make_book_key( std::numeric_limits<uint64_t>::max() - price.base, id ); }
+
+      /**
+       *  Orders of one trader, oldest first. The market half of the (trader, market)
+       *  pair is the table scope, so the low bits hold the order id.
+       */
+      uint128_t by_trader() const { return trader_key( trader, id ); }
+
+      /**
+       *  Earliest expiration first; orders without expiration sort last.
+       */
+      uint64_t  by_expiry() const { return expiry_key( expiration ); }
+   };
+
+   static constexpr uint128_t trader_key( name trader, uint64_t id ) {
+      return (uint128_t(trader.value) << 64) | id;
+   }
+
+   static uint64_t expiry_key( time_point_sec expiration ) {
+      return expiration == time_point_sec() ? std::numeric_limits<uint64_t>::max() : expiration.sec_since_epoch();
+   }
+
+   static bool is_expired( time_point_sec expiration, time_point_sec now ) {
+      return expiry_key( expiration ) <= now.sec_since_epoch();
+   }
+
+   typedef eosio::multi_index<"askorders"_n, order,
+                              indexed_by<"bybook"_n, const_mem_fun<order, uint128_t, &order::by_ask>>,
+                              indexed_by<"bytrader"_n, const_mem_fun<order, uint128_t, &order::by_trader>>,
+                              indexed_by<"byexpiry"_n, const_mem_fun<order, uint64_t, &order::by_expiry>>
+                             > askorders;
+
+   typedef eosio::multi_index<"bidorders"_n, order,
+                              indexed_by<"bybook"_n, const_mem_fun<order, uint128_t, &order::by_bid>>,
+                              indexed_by<"bytrader"_n, const_mem_fun<order, uint128_t, &order::by_trader>>,
+                              indexed_by<"byexpiry"_n, const_mem_fun<order, uint64_t, &order::by_expiry>>
+                             > bidorders;
+
+
+   /**
+    *  Contract wide state. `next_order_id` hands out the insertion sequence used
+    *  both as order primary key and as the time component of the book key.
+    */
+   struct [[eosio::table]] exstate {
+      uint64_t   next_order_id = 1;
+   };
+
+   typedef eosio::singleton<"exstate"_n, exstate> exstate_singleton;
+
+
+   static constexpr uint128_t pair_key( const extended_symbol& base, const extended_symbol& quote ) {
+      return (uint128_t(base.get_symbol().raw() ^ base.get_contract().value) << 64)
+           | (quote.get_symbol().raw() ^ quote.get_contract().value);
+   }
+
+   /**
+    *  A market pairs a base asset (the one prices are quoted in) with a quote asset
+    *  (the one volumes are quoted in). Markets get dense numeric ids at creation and
+    *  the order tables of a market are scoped by its id.
+    *
+    *  The `bypair` key folds each extended symbol into 64 bits, so different pairs may
+    *  share a key; lookups compare the symbols of every row with the searched key.
+    *
+    *  `trade_seq` counts the fills of the market and `trade_capacity` is the number of
+    *  slots of its `recenttrades` ring buffer. A candle series is kept for each interval
+    *  (in seconds) of `candle_intervals`. Fees are charged in basis points of what the
+    *  maker and the taker of a fill receive.
+    */
+   struct [[eosio::table]] market {
+      uint64_t          id;
+      extended_symbol   base;
+      extended_symbol   quote;
+      uint64_t          trade_seq = 0;
+      uint16_t          trade_capacity = 0;
+      std::vector<uint32_t> candle_intervals;
+      uint16_t          maker_fee = 0;
+      uint16_t          taker_fee = 0;
+
+      uint64_t  primary_key() const { return id; }
+      uint128_t by_pair() const { return pair_key( base, quote ); }
+   };
+
+   typedef eosio::multi_index<"markets"_n, market,
+                              indexed_by<"bypair"_n, const_mem_fun<market, uint128_t, &market::by_pair>>
+                             > markets;
+
+
+   /**
+    *  An incoming order whose matching did not finish within the fill budget of the
+    *  action that submitted it. The remainder waits here, scoped by market and in
+    *  submission order, until `match` (or the next `trade` on the market) resumes it.
+    *
+    *  `locked` holds the funds taken from the trader's balance for the remainder:
+    *  base tokens for a bid, quote tokens for an ask.
+    */
+   struct [[eosio::table]] match_cursor {
+      uint64_t         id;
+      name             trader;
+      name             side;
+      order_price      price;
+      asset            volume;
+      asset            locked;
+      time_point_sec   timestamp;
+      time_point_sec   expiration;
+
+      uint64_t  primary_key() const { return id; }
+      uint128_t by_trader() const { return trader_key( trader, id ); }
+   };
+
+   typedef eosio::multi_index<"cursors"_n, match_cursor,
+                              indexed_by<"bytrader"_n, const_mem_fun<match_cursor, uint128_t, &match_cursor::by_trader>>
+                             > cursors;
+
+
+   /**
+    *  Number of open orders, resting or parked, of one trader on market `market_id`.
+    *  Scoped by trader, so `cancelall` without a market visits only the markets the
+    *  trader has orders on. The row goes away with the trader's last order there.
+    */
+   struct [[eosio::table]] trader_market {
+      uint64_t   market_id;
+      uint32_t   orders;
+
+      uint64_t primary_key() const { return market_id; }
+   };
+
+   typedef eosio::multi_index<"openorders"_n, trader_market> openorders;
+
+
+   /**
+    *  One of the last `trade_capacity` fills of a market. Fill number `seq` is stored
+    *  in slot `seq % trade_capacity`, overwriting the fill `trade_capacity` before it,
+    *  so the table never grows past its capacity and every fill costs one row write.
+    */
+   struct [[eosio::table]] trade_record {
+      uint64_t         slot;
+      uint64_t         seq;
+      name             maker;
+      name             taker;
+      order_price      price;
+      asset            volume;
+      uint64_t         maker_order_id;
+      uint64_t         taker_order_id;
+      time_point_sec   timestamp;
+
+      uint64_t primary_key() const { return slot; }
+   };
+
+   typedef eosio::multi_index<"recenttrades"_n, trade_record> recenttrades;
+
+   /**
+    *  Ring buffer capacity of a new market
+    */
+   static constexpr uint16_t default_trade_capacity = 100;
+
+
+   /**
+    *  Open, high, low and close price, volume and number of fills of one market over
+    *  `interval` seconds starting at `start`. Keyed by interval, then start, so each
+    *  series is one contiguous, chronological range of the table.
+    */
+   struct [[eosio::table]] candle {
+      uint64_t         key;
+      uint32_t         interval;
+      time_point_sec   start;
+      order_price      open;
+      order_price      high;
+      order_price      low;
+      order_price      close;
+      asset            base_volume;
+      asset            quote_volume;
+      uint32_t         trades;
+
+      uint64_t primary_key() const { return key; }
+   };
+
+   typedef eosio::multi_index<"candles"_n, candle> candles;
+
+   static constexpr uint64_t candle_key( uint32_t interval, uint32_t start ) {
+      return (uint64_t(interval) << 32) | start;
+   }
+
+   /**
+    *  Candle intervals of a new market: one minute, one hour and one day
+    */
+   static std::vector<uint32_t> default_candle_intervals() {
+      return { 60, 3600, 86400 };
+   }
+
+
+   /**
+    *  Highest maker or taker fee, in basis points
+    */
+   static constexpr uint16_t max_fee = 1000;
+
+   /**
+    *  Fees collected on a market and not claimed yet, one row per token of the market:
+    *  `base_fees` for the base token and `quote_fees` for the quote token.
+    */
+   struct [[eosio::table]] fee_pool {
+      uint64_t         id;
+      extended_asset   balance;
+
+      uint64_t primary_key() const { return id; }
+   };
+
+   typedef eosio::multi_index<"fees"_n, fee_pool> fee_pools;
+
+   static constexpr uint64_t base_fees  = 0;
+   static constexpr uint64_t quote_fees = 1;
+
+   /**
+    *  Account running the `exchange.results` contract. Every fill is reported to it
+    *  as an inline `fill` action, so trade history lives in action traces instead of
+    *  table rows.
+    */
+   static constexpr name results_account{"exch.results"_n};
+
+   static constexpr name bid_side{"bid"_n};
+   static constexpr name ask_side{"ask"_n};
+
+   /**
+    *  Time in force of an order. An empty name is the same as `gtc`: the order rests
+    *  until filled, cancelled or expired. `ioc` orders never rest, `fok` orders fill in
+    *  full within their fill budget or fail, and `post` orders fail if they would cross.
+    */
+   static constexpr name good_till_cancel{"gtc"_n};
+   static constexpr name immediate_or_cancel{"ioc"_n};
+   static constexpr name fill_or_kill{"fok"_n};
+   static constexpr name post_only{"post"_n};
+
+   /**
+    *  Fill budget of an order placed by a transfer memo that does not give one
+    */
+   static constexpr uint16_t default_memo_fills = 20;
+
+   /**
+    *  Expired orders removed by a trading action on its market before it matches
+    */
+   static constexpr uint16_t expiry_sweep_budget = 8;
+
+   /**
+    *  Provides an abstracted interface around storing balances for users. Balance
+    *  deltas are collected in memory for the duration of an action, and `flush`
+    *  writes every touched (owner, token) row exactly once with the net delta, in
+    *  (owner, token) order, with one read and one write per row. The overdraw check
+    *  is made on the net result of each row, so intermediate states of a sweep may
+    *  dip below zero as long as the final balance does not.
+    *
+    *  Fees charged on fills are collected the same way and added to the fee pool of
+    *  each (market, token) once per action.
+    */
+   struct exchange_accounts {
+      exchange_accounts( name code ) : _self( code ){}
+
+      void adjust_balance( name owner, extended_asset delta ) {
+         _deltas[{owner, delta.get_extended_symbol()}] += delta.quantity.amount;
+      }
+
+      void accrue_fee( uint64_t market_id, uint64_t pool, extended_asset fee ) {
+         if( fee.quantity.amount == 0 )
+            return;
+         auto& accrued = _fees.try_emplace( {market_id, pool}, 0, fee.get_extended_symbol() ).first->second;
+         accrued.quantity.amount += fee.quantity.amount;
+      }
+
+      void flush() {
+         for( const auto& d : _deltas ) {
+            if( d.second != 0 )
+               write_balance( d.first.first, extended_asset( d.second, d.first.second ) );
+         }
+         _deltas.clear();
+
+         for( const auto& f : _fees ) {
+            write_fee( f.first.first, f.first.second, f.second );
+         }
+         _fees.clear();
+      }
+
+      private:
+         void write_balance( name owner, extended_asset delta ) {
+            exbalances _exbalances_table( _self, owner.value );
+            auto idx = _exbalances_table.get_index<"bytoken"_n>();
+
+            auto userbalance = idx.find( token_key( delta.get_extended_symbol() ) );
+            if( userbalance == idx.end() ) {
+               check( delta.quantity.amount >= 0, "overdrawn balance" );
+               _exbalances_table.emplace( _self, [&]( auto& exb ){
+                  exb.id      = _exbalances_table.available_primary_key();
+                  exb.balance = delta;
+               });
+            } else {
+               idx.modify( userbalance, same_payer, [&]( auto& exb ) {
+                  exb.balance.quantity += delta.quantity;
+                  check( exb.balance.quantity.amount >= 0, "overdrawn balance" );
+               });
+            }
+         }
+
+         void write_fee( uint64_t market_id, uint64_t pool, const extended_asset& fee ) {
+            fee_pools _fee_pools( _self, market_id );
+            auto itr = _fee_pools.find( pool );
+            if( itr == _fee_pools.end() ) {
+               _fee_pools.emplace( _self, [&]( auto& p ) {
+                  p.id      = pool;
+                  p.balance = fee;
+               });
+            } else {
+               _fee_pools.modify( itr, same_payer, [&]( auto& p ) {
+                  p.balance.quantity += fee.quantity;
+               });
+            }
+         }
+
+         name _self;
+         /**
+          *  Net balance change of every (owner, token) touched by the current action
+          */
+         std::map<std::pair<name, extended_symbol>, int64_t> _deltas;
+         /**
+          *  Fees charged by the current action, by (market, fee pool)
+          */
+         std::map<std::pair<uint64_t, uint64_t>, extended_asset> _fees;
+   };
+
+
+   /**
+    *  Aggregated depth of one price level of a market: the total open volume and the
+    *  number of resting orders at `price`. Asks and bids live in separate tables
+    *  scoped by market, keyed so that the best level is the first row.
+    */
+   struct [[eosio::table]] price_level {
+      uint64_t      key;
+      order_price   price;
+      asset         volume;
+      uint32_t      orders;
+
+      uint64_t primary_key() const { return key; }
+   };
+
+   typedef eosio::multi_index<"askdepth"_n, price_level> askdepth;
+   typedef eosio::multi_index<"biddepth"_n, price_level> biddepth;
+
+   /**
+    *  Primary key of a price level: the price for asks and the inverted price for bids.
+    */
+   static uint64_t level_key( bool bids, const order_price& price ) {
+      return bids ? std::numeric_limits<uint64_t>::max() - price.base : price.base;
+   }
+
+   /**
+    *  The tables of one market, opened once per action and shared by every order the
+    *  action places, cancels or matches on that market. This is the multi_index storage
+    *  policy of the matching core in `matching.hpp`: balance changes and fees go to the
+    *  action's `exchange_accounts`, fills are reported and recorded here.
+    *
+    *  Depth changes are accumulated per price level while the action runs and each
+    *  touched level row is written once when the book goes out of scope.
+    */
+   struct market_book {
+      market         mkt;
+      uint64_t       scope;
+      askorders      asks;
+      bidorders      bids;
+      cursors        pending;
+      recenttrades   trades;
+
+      market_book( name self, const market& m, exchange_accounts& accounts )
+      :mkt( m ), scope( m.id ),
+       asks( self, scope ), bids( self, scope ), pending( self, scope ), trades( self, scope ),
+       _self( self ), _accounts( accounts ), _now( current_time_point() ), _trade_seq( m.trade_seq ) {}
+
+      ~market_book() {
+         flush_depth();
+         flush_open_orders();
+         flush_trade_seq();
+         flush_candles();
+      }
+
+      bool is_bid( const match_cursor& c ) const { return c.side == bid_side; }
+      bool is_expired( time_point_sec expiration ) const { return exchange::is_expired( expiration, _now ); }
+      uint16_t maker_fee() const { return mkt.maker_fee; }
+      uint16_t taker_fee() const { return mkt.taker_fee; }
+
+      const order* best_order( bool bids_side ) {
+         return bids_side ? front( bids.get_index<"bybook"_n>() ) : front( asks.get_index<"bybook"_n>() );
+      }
+
+      template<typename F>
+      void walk_book( bool bids_side, F f ) {
+         if( bids_side ) {
+            auto idx = bids.get_index<"bybook"_n>();
+            for( auto itr = idx.begin(); itr != idx.end() && f( *itr ); ++itr ) {}
+         } else {
+            auto idx = asks.get_index<"bybook"_n>();
+            for( auto itr = idx.begin(); itr != idx.end() && f( *itr ); ++itr ) {}
+         }
+      }
+
+      const order* find_order( bool bids_side, uint64_t id ) {
+         if( bids_side ) {
+            auto itr = bids.find( id );
+            return itr != bids.end() ? &*itr : nullptr;
+         }
+         auto itr = asks.find( id );
+         return itr != asks.end() ? &*itr : nullptr;
+      }
+
+      const order* first_to_expire( bool bids_side ) {
+         return bids_side ? front( bids.get_index<"byexpiry"_n>() ) : front( asks.get_index<"byexpiry"_n>() );
+      }
+
+      const order* first_of_trader( bool bids_side, name trader ) {
+         const order* o = bids_side ? lower_bound( bids.get_index<"bytrader"_n>(), trader_key( trader, 0 ) )
+                                    : lower_bound( asks.get_index<"bytrader"_n>(), trader_key( trader, 0 ) );
+         return o != nullptr && o->trader == trader ? o : nullptr;
+      }
+
+      void insert_order( const match_cursor& taker ) {
+         auto fill_order = [&]( auto& o ) {
+            o.id         = taker.id;
+            o.trader     = taker.trader;
+            o.price      = taker.price;
+            o.volume     = taker.volume;
+            o.timestamp  = taker.timestamp;
+            o.expiration = taker.expiration;
+         };
+         if( is_bid( taker ) ) {
+            bids.emplace( _self, fill_order );
+         } else {
+            asks.emplace( _self, fill_order );
+         }
+         _open_deltas[taker.trader] += 1;
+      }
+
+      void reduce_order( bool bids_side, const order& o, int64_t traded ) {
+         auto reduce = [&]( auto& row ) { row.volume.amount -= traded; };
+         if( bids_side ) {
+            bids.modify( o, same_payer, reduce );
+         } else {
+            asks.modify( o, same_payer, reduce );
+         }
+      }
+
+      void erase_order( bool bids_side, const order& o ) {
+         _open_deltas[o.trader] -= 1;
+         if( bids_side ) {
+            bids.erase( o );
+         } else {
+            asks.erase( o );
+         }
+      }
+
+      const match_cursor* first_parked() {
+         auto itr = pending.begin();
+         return itr != pending.end() ? &*itr : nullptr;
+      }
+
+      const match_cursor* find_parked( uint64_t id ) {
+         auto itr = pending.find( id );
+         return itr != pending.end() ? &*itr : nullptr;
+      }
+
+      const match_cursor* first_parked_of_trader( name trader ) {
+         auto idx = pending.get_index<"bytrader"_n>();
+         auto itr = idx.lower_bound( trader_key( trader, 0 ) );
+         return itr != idx.end() && itr->trader == trader ? &*itr : nullptr;
+      }
+
+      void park( const match_cursor& taker ) {
+         pending.emplace( _self, [&]( auto& c ) { c = taker; } );
+         _open_deltas[taker.trader] += 1;
+      }
+
+      void update_parked( const match_cursor& taker ) {
+         pending.modify( pending.find( taker.id ), same_payer, [&]( auto& c ) { c = taker; } );
+      }
+
+      void unpark( const match_cursor& taker ) {
+         pending.erase( pending.find( taker.id ) );
+         _open_deltas[taker.trader] -= 1;
+      }
+
+      void credit( name owner, bool base, int64_t amount ) {
+         _accounts.adjust_balance( owner, extended_asset( amount, base ? mkt.base : mkt.quote ) );
+      }
+
+      void accrue_fee( bool base, int64_t amount ) {
+         _accounts.accrue_fee( mkt.id, base ? base_fees : quote_fees, extended_asset( amount, base ? mkt.base : mkt.quote ) );
+      }
+
+      /**
+       *  Reports a fill of `traded` quote volume for `value` base between `maker` and `taker`
+       *  to the results account, stores it in the market's recent trades and adds it to the
+       *  market's candles.
+       */
+      void record_fill( const order& maker, const match_cursor& taker, int64_t traded, int64_t value ) {
+         exchange_results::fill_action fill_act( results_account, std::vector<eosio::permission_level>{ } );
+         fill_act.send( mkt.id, maker.trader, taker.trader, asset( maker.price.base, mkt.base.get_symbol() ),
+                        asset( traded, mkt.quote.get_symbol() ), maker.id, taker.id );
+
+         trade_record t;
+         t.maker          = maker.trader;
+         t.taker          = taker.trader;
+         t.price          = maker.price;
+         t.volume         = asset( traded, mkt.quote.get_symbol() );
+         t.maker_order_id = maker.id;
+         t.taker_order_id = taker.id;
+         t.timestamp      = _now;
+         record_trade( t );
+
+         update_candles( _now, maker.price, value, traded );
+      }
+
+      /**
+       *  Adds a fill to the current candle of every interval of the market. Candles are
+       *  read at most once per action and written back once by `flush_candles`.
+       */
+      void update_candles( time_point_sec now, const order_price& price, int64_t base_amount, int64_t quote_amount ) {
+         for( uint32_t interval : mkt.candle_intervals ) {
+            const uint32_t start = now.sec_since_epoch() - now.sec_since_epoch() % interval;
+            const uint64_t key   = candle_key( interval, start );
+
+            auto bucket = _candles.find( key );
+            if( bucket == _candles.end() ) {
+               candles series( _self, scope );
+               auto itr = series.find( key );
+               if( itr != series.end() ) {
+                  bucket = _candles.emplace( key, std::make_pair( *itr, false ) ).first;
+               } else {
+                  candle c;
+                  c.key          = key;
+                  c.interval     = interval;
+                  c.start        = time_point_sec( start );
+                  c.open         = price;
+                  c.high         = price;
+                  c.low          = price;
+                  c.base_volume  = asset( 0, mkt.base.get_symbol() );
+                  c.quote_volume = asset( 0, mkt.quote.get_symbol() );
+                  c.trades       = 0;
+                  bucket = _candles.emplace( key, std::make_pair( c, true ) ).first;
+               }
+            }
+
+            candle& c = bucket->second.first;
+            if( c.high < price ) c.high = price;
+            if( price < c.low )  c.low  = price;
+            c.close                = price;
+            c.base_volume.amount  += base_amount;
+            c.quote_volume.amount += quote_amount;
+            ++c.trades;
+         }
+      }
+
+      /**
+       *  Emplaces the candles started by this action and modifies the others in place.
+       */
+      void flush_candles() {
+         if( _candles.empty() )
+            return;
+
+         candles series( _self, scope );
+         for( const auto& p : _candles ) {
+            const candle& c = p.second.first;
+            if( p.second.second ) {
+               series.emplace( _self, [&]( auto& row ) { row = c; } );
+            } else {
+               series.modify( series.get( c.key ), same_payer, [&]( auto& row ) { row = c; } );
+            }
+         }
+         _candles.clear();
+      }
+
+      /**
+       *  Writes a fill into the next slot of the market's ring buffer. The slot row is
+       *  created on the first lap and overwritten in place after that.
+       */
+      void record_trade( const trade_record& t ) {
+         const uint64_t seq = mkt.trade_seq++;
+         if( mkt.trade_capacity == 0 )
+            return;
+
+         const uint64_t slot = seq % mkt.trade_capacity;
+         auto fill_record = [&]( auto& r ) {
+            r      = t;
+            r.slot = slot;
+            r.seq  = seq;
+         };
+         auto itr = trades.find( slot );
+         if( itr == trades.end() ) {
+            trades.emplace( _self, fill_record );
+         } else {
+            trades.modify( itr, same_payer, fill_record );
+         }
+      }
+
+      /**
+       *  Stores the market's fill count once per action.
+       */
+      void flush_trade_seq() {
+         if( mkt.trade_seq == _trade_seq )
+            return;
+         markets _markets( _self, _self.value );
+         _markets.modify( _markets.get( mkt.id ), same_payer, [&]( auto& m ) {
+            m.trade_seq = mkt.trade_seq;
          });
+         _trade_seq = mkt.trade_seq;
+      }
+
+      void adjust_level( bool bids_side, const order_price& price, int64_t volume, int32_t orders ) {
+         auto& delta = _depth_deltas[{bids_side, level_key( bids_side, price )}];
+         delta.price   = price;
+         delta.volume += volume;
+         delta.orders += orders;
       }
 
+      void flush_depth() {
+         for( const auto& d : _depth_deltas ) {
+            if( d.first.first ) {
+               biddepth levels( _self, scope );
+               write_level( levels, d.first.second, d.second );
+            } else {
+               askdepth levels( _self, scope );
+               write_level( levels, d.first.second, d.second );
+            }
+         }
+         _depth_deltas.clear();
+      }
+
+      /**
+       *  Writes the open order count of every trader whose orders on this market
+       *  changed, once per trader.
+       */
+      void flush_open_orders() {
+         for( const auto& d : _open_deltas ) {
+            if( d.second == 0 )
+               continue;
+
+            openorders open( _self, d.first.value );
+            auto itr = open.find( mkt.id );
+            if( itr == open.end() ) {
+               check( d.second > 0, "open order count underflow" );
+               open.emplace( _self, [&]( auto& t ) {
+                  t.market_id = mkt.id;
+                  t.orders    = d.second;
+               });
+            } else if( int64_t(itr->orders) + d.second == 0 ) {
+               open.erase( itr );
+            } else {
+               check( int64_t(itr->orders) + d.second > 0, "open order count underflow" );
+               open.modify( itr, same_payer, [&]( auto& t ) {
+                  t.orders += d.second;
+               });
+            }
+         }
+         _open_deltas.clear();
+      }
+
+      private:
+         template<typename Index>
+         static const order* front( const Index& idx ) {
+            auto itr = idx.begin();
+            return itr != idx.end() ? &*itr : nullptr;
+         }
+
+         template<typename Index>
+         static const order* lower_bound( const Index& idx, uint128_t key ) {
+            auto itr = idx.lower_bound( key );
+            return itr != idx.end() ? &*itr : nullptr;
+         }
+
+         struct level_delta {
+            order_price   price;
+            int64_t       volume = 0;
+            int32_t       orders = 0;
+         };
+
+         template<typename Levels>
+         void write_level( Levels& levels, uint64_t key, const level_delta& delta ) {
+            if( delta.volume == 0 && delta.orders == 0 )
+               return;
+
+            auto itr = levels.find( key );
+            if( itr == levels.end() ) {
+               check( delta.volume > 0 && delta.orders > 0, "price level underflow" );
+               levels.emplace( _self, [&]( auto& l ) {
+                  l.key    = key;
+                  l.price  = delta.price;
+                  l.volume = asset( delta.volume, mkt.quote.get_symbol() );
+                  l.orders = delta.orders;
+               });
+            } else if( itr->orders + delta.orders == 0 ) {
+               check( itr->volume.amount + delta.volume == 0, "price level volume mismatch" );
+               levels.erase( itr );
+            } else {
+               levels.modify( itr, same_payer, [&]( auto& l ) {
+                  l.volume.amount += delta.volume;
+                  l.orders        += delta.orders;
+                  check( l.volume.amount > 0 && int32_t(l.orders) > 0, "price level underflow" );
+               });
+            }
+         }
+
+         name                 _self;
+         exchange_accounts&   _accounts;
+         time_point_sec       _now;
+         uint64_t             _trade_seq;
+         std::map<std::pair<bool, uint64_t>, level_delta> _depth_deltas;
+         /**
+          *  Net change of the open orders of every trader touched by the current action
+          */
+         std::map<name, int32_t> _open_deltas;
+         /**
+          *  Candles touched by the current action and whether each one is new
+          */
+         std::map<uint64_t, std::pair<candle, bool>> _candles;
+   };
+
+   /**
+    *  A limit order submitted as part of a `placeorders` batch. A non-zero
+    *  `replace_id` cancels that resting order of the trader before placing this one.
+    *  `expiration` and `time_in_force` work as in `trade`.
+    */
+   struct order_spec {
+      uint64_t         market_id;
+      name             side;
+      asset            price;
+      asset            volume;
+      uint64_t         replace_id = 0;
+      uint16_t         max_fills = 0;
+      time_point_sec   expiration;
+      name             time_in_force;
+   };
+
+   markets::const_iterator _find_market( const markets& _markets, const extended_symbol& base, const extended_symbol& quote );
+   void _place_order( market_book& book, name trader, name side, asset price, asset volume, uint16_t max_fills,
+                      time_point_sec expiration, name time_in_force );
+   void _cancel_order( market_book& book, name trader, name side, uint64_t order_id );
+
+   /**
+    *  Transfer memos are read in place, field by field, without copying:
+    *
+    *    d:<contract>                                deposit of a token of <contract>
+    *    t:<market_id>:<side>:<price>[:<max_fills>][:<time_in_force>]
+    *                                                deposit, then place a limit order
+    *    anything else                               deposit; the memo is free text
+    */
+   static std::string_view next_memo_field( std::string_view& memo );
+   static uint64_t parse_memo_uint( std::string_view field );
+   static int64_t parse_memo_amount( std::string_view field, symbol sym );
+   void _deposit_and_trade( name trader, const extended_asset& deposit, std::string_view memo );
+
+
+   /**
+    *  Hands out order ids. The counter is read with the action's first order and
+    *  stored once by `_flush_order_id` when the action ends.
+    */
+   uint64_t _next_order_id() {
+      if( _order_id == 0 ) {
+         exstate_singleton _exstate( get_self(), get_self().value );
+         _order_id = _stored_order_id = _exstate.get_or_default().next_order_id;
+      }
+      return _order_id++;
+   }
+
+   void _flush_order_id() {
+      if( _order_id == _stored_order_id )
+         return;
+      exstate_singleton _exstate( get_self(), get_self().value );
+      auto state = _exstate.get_or_default();
+      state.next_order_id = _order_id;
+      _exstate.set( state, get_self() );
+      _stored_order_id = _order_id;
+   }
+
+   /**
+    *  Whitelist lookups made by the current action, by token contract
+    */
+   bool _is_approved_token( name contract ) {
+      auto cached = _approved_tokens.find( contract );
+      if( cached == _approved_tokens.end() ) {
+         token_contracts _tokens( get_self(), get_self().value );
+         cached = _approved_tokens.emplace( contract, _tokens.find( contract.value ) != _tokens.end() ).first;
+      }
+      return cached->second;
    }
 
-   name              _self;
+   name                   _self;
    // token             _excurrencies;
-   // exchange_accounts _accounts;
+   exchange_accounts      _accounts;
+   std::map<name, bool>   _approved_tokens;
+   /**
+    *  Next order id and the value stored in `exstate`, zero until the first order
+    */
+   uint64_t               _order_id = 0;
+   uint64_t               _stored_order_id = 0;
 
 
    public:
       exchange( name receiver, name code, datastream<const char*> ds )
-      :contract( receiver, code, ds )//,
+      :contract( receiver, code, ds ),
       // _excurrencies(receiver),
-      // _accounts( get_self() )
+      _accounts( get_self() )
       {}
 
+      ~exchange() {
+         _accounts.flush();
+         _flush_order_id();
+      }
+
       [[eosio::action]]
       void deposit( name from, extended_asset quantity );
 
+      /**
+       *  Debits `quantity` from the exchange balance of `from` and transfers it to `from`.
+       */
       [[eosio::action]]
       void withdraw( name  from, extended_asset quantity );
 
-      [[eosio::on_notify("eosio.token::transfer")]]
+      /**
+       *  Withdraws the whole balance of each token in `tokens`, or of every token when
+       *  not given, with one transfer per token, and removes the emptied balance rows.
+       */
+      [[eosio::action]]
+      void withdrawall( name owner, std::optional<std::vector<extended_symbol>> tokens );
+
+      /**
+       *  Approves transfers from token contract `contract` as deposits.
+       */
+      [[eosio::action]]
+      void addtoken( name contract );
+
+      /**
+       *  Withdraws the approval of token contract `contract`. Balances already held in
+       *  its tokens can still be traded and withdrawn.
+       */
+      [[eosio::action]]
+      void removetoken( name contract );
+
+      /**
+       *  Lists a new market trading `quote` against `base` under the next market id.
+       */
+      [[eosio::action]]
+      void createmarket( extended_symbol base, extended_symbol quote );
+
+      /**
+       *  Resizes the `recenttrades` ring buffer of market `market_id` to `capacity` slots;
+       *  zero stops recording. Slots beyond a smaller capacity are removed.
+       */
+      [[eosio::action]]
+      void settradecap( uint64_t market_id, uint16_t capacity );
+
+      /**
+       *  Sets the candle intervals of market `market_id`, in seconds. Series already
+       *  recorded are kept; removed intervals simply stop updating.
+       */
+      [[eosio::action]]
+      void setcandles( uint64_t market_id, std::vector<uint32_t> intervals );
+
+      /**
+       *  Sets the maker and taker fees of market `market_id`, in basis points of what the
+       *  maker and the taker of each fill receive.
+       */
+      [[eosio::action]]
+      void setfees( uint64_t market_id, uint16_t maker_fee, uint16_t taker_fee );
+
+      /**
+       *  Pays the fees collected on `market_ids` to `to`, with one transfer per token.
+       */
+      [[eosio::action]]
+      void claimfees( name to, std::vector<uint64_t> market_ids );
+
+      /**
+       *  Places a bid or ask limit order on market `market_id`. The crossing part of the
+       *  order is matched immediately with at most `max_fills` fills; a remainder that
+       *  still crosses the book is parked in a match cursor for `match` to resume, and
+       *  the rest of the order is placed on the book. A non-zero `expiration` makes the
+       *  order good until that time; expired orders are removed instead of filled.
+       *
+       *  `time_in_force` changes what happens to the order: `ioc` refunds whatever is
+       *  not filled right away, `fok` fails unless a dry run shows the order fills in
+       *  full within `max_fills`, and `post` fails if the order would cross the book.
+       */
+      [[eosio::action]]
+      void trade( name trader, uint64_t market_id, name order_type, asset price, asset volume, uint16_t max_fills,
+                  time_point_sec expiration, name time_in_force );
+
+      /**
+       *  Places or replaces a batch of limit orders for `trader`. Markets, balances and
+       *  order books are loaded once for the whole batch.
+       */
+      [[eosio::action]]
+      void placeorders( name trader, std::vector<order_spec> orders );
+
+      /**
+       *  Cancels the order `order_id` of `trader`, resting on the book or parked in a
+       *  cursor, and releases its locked funds.
+       */
+      [[eosio::action]]
+      void cancelorder( name trader, uint64_t market_id, name side, uint64_t order_id );
+
+      /**
+       *  Cancels up to `max` orders of `trader`, on `market_id` only when given and on
+       *  every market the trader has open orders on otherwise. Orders are found through
+       *  the `bytrader` indexes and the released funds are written back once per token.
+       */
+      [[eosio::action]]
+      void cancelall( name trader, std::optional<uint64_t> market_id, uint16_t max );
+
+      /**
+       *  Resumes parked orders of market `market_id` with at most `max` fills. Anybody can
+       *  call this action.
+       */
+      [[eosio::action]]
+      void match( uint64_t market_id, uint16_t max );
+
+      /**
+       *  Removes up to `max` expired orders, earliest expiration first, market by market,
+       *  and releases their locked funds. Anybody can call this action.
+       */
+      [[eosio::action]]
+      void expire( uint16_t max );
+
+      /**
+       *  Moves the balances of `owner` from the legacy `exaccounts` map row into one
+       *  `exbalances` row per token and removes the legacy row.
+       */
+      [[eosio::action]]
+      void migrate( name owner );
+
+      /**
+       *  Credits transfers of any approved token contract, taken from the first
+       *  receiver of the notification, and handles the memo grammar above.
+       */
+      [[eosio::on_notify("*::transfer")]]
       void transfer(name from, name to, asset quantity, string memo);
 
    };
@@ -0,0 +1,6 @@
+#include <token.exchange/exchange.results.hpp>
+
+void exchange_results::fill( uint64_t market, const name& maker, const name& taker, const asset& price, const asset& volume,
+                             uint64_t maker_order_id, uint64_t taker_order_id ) { }
+
+extern "C" void apply( uint64_t, uint64_t, uint64_t ) { }
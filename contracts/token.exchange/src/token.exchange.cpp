@@ -1,4 +1,3 @@
-#include <math.h>
 #include <token.exchange/token.exchange.hpp>
 
 namespace eosio {
@@ -23,15 +22,400 @@ namespace eosio {
       require_auth( from );
 
       check( quantity.quantity.is_valid(), "invalid quantity" );
-      check( quantity.quantity.amount >= 0, "cannot withdraw negative balance" ); // Redundant? inline_transfer will fail if quantity is not positive.
-      // _accounts.adjust_balance( from, -quantity );
+      check( quantity.quantity.amount > 0, "must withdraw positive quantity" );
+      _accounts.adjust_balance( from, -quantity );
 
-      action(
-         permission_level{ get_self(), "active"_n },
-         "eosio.token"_n,
-         "transfer"_n,
-         std::make_tuple( get_self(), from, quantity, std::string("withdraw") )
-      ).send();
+      token::transfer_action transfer_act( quantity.contract, { get_self(), "active"_n } );
+      transfer_act.send( get_self(), from, quantity.quantity, std::string("withdraw") );
+   }
+
+
+   void exchange::withdrawall( name owner, std::optional<std::vector<extended_symbol>> tokens ) {
+      require_auth( owner );
+
+      exbalances _exbalances_table( get_self(), owner.value );
+      std::vector<extended_asset> payouts;
+
+      auto withdraw_row = [&]( auto itr ) {
+         if( itr->balance.quantity.amount > 0 )
+            payouts.push_back( itr->balance );
+         return _exbalances_table.erase( itr );
+      };
+
+      if( tokens ) {
+         auto idx = _exbalances_table.get_index<"bytoken"_n>();
+         for( const auto& sym : *tokens ) {
+            auto row = idx.find( token_key( sym ) );
+            check( row != idx.end(), "no balance to withdraw" );
+            withdraw_row( _exbalances_table.iterator_to( *row ) );
+         }
+      } else {
+         for( auto itr = _exbalances_table.begin(); itr != _exbalances_table.end(); ) {
+            itr = withdraw_row( itr );
+         }
+      }
+      check( !payouts.empty(), "nothing to withdraw" );
+
+      // transfers to the same token contract go out back to back
+      std::sort( payouts.begin(), payouts.end(), []( const auto& a, const auto& b ) {
+         return token_key( a.get_extended_symbol() ) < token_key( b.get_extended_symbol() );
+      });
+      for( const auto& p : payouts ) {
+         token::transfer_action transfer_act( p.contract, { get_self(), "active"_n } );
+         transfer_act.send( get_self(), owner, p.quantity, std::string("withdraw") );
+      }
+   }
+
+
+   void exchange::migrate( name owner ) {
+      exaccounts _exaccounts_table( get_self(), owner.value );
+      auto useraccounts = _exaccounts_table.require_find( owner.value, "no legacy exchange account" );
+
+      for( const auto& balance : useraccounts->balances ) {
+         _accounts.adjust_balance( owner, extended_asset( balance.second, balance.first ) );
+      }
+      _exaccounts_table.erase( useraccounts );
+   }
+
+
+   void exchange::addtoken( name contract ) {
+      require_auth( get_self() );
+      check( is_account( contract ), "token contract account does not exist" );
+
+      token_contracts _tokens( get_self(), get_self().value );
+      check( _tokens.find( contract.value ) == _tokens.end(), "token contract already approved" );
+      _tokens.emplace( get_self(), [&]( auto& t ) {
+         t.contract = contract;
+      });
+   }
+
+
+   void exchange::removetoken( name contract ) {
+      require_auth( get_self() );
+
+      token_contracts _tokens( get_self(), get_self().value );
+      _tokens.erase( _tokens.get( contract.value, "token contract is not approved" ) );
+   }
+
+
+   void exchange::createmarket( extended_symbol base, extended_symbol quote ) {
+      require_auth( get_self() );
+
+      check( base.get_symbol().is_valid() && quote.get_symbol().is_valid(), "invalid symbol" );
+      check( base != quote, "base and quote must differ" );
+
+      markets _markets( get_self(), get_self().value );
+      check( _find_market( _markets, base, quote ) == _markets.end(), "market already exists" );
+
+      _markets.emplace( get_self(), [&]( auto& m ) {
+         m.id             = std::max( _markets.available_primary_key(), uint64_t(1) );
+         m.base           = base;
+         m.quote          = quote;
+         m.trade_capacity   = default_trade_capacity;
+         m.candle_intervals = default_candle_intervals();
+      });
+   }
+
+
+   void exchange::settradecap( uint64_t market_id, uint16_t capacity ) {
+      require_auth( get_self() );
+
+      markets _markets( get_self(), get_self().value );
+      const auto& mkt = _markets.get( market_id, "market does not exist" );
+
+      recenttrades trades( get_self(), market_id );
+      for( auto itr = trades.lower_bound( capacity ); itr != trades.end(); ) {
+         itr = trades.erase( itr );
+      }
+
+      _markets.modify( mkt, same_payer, [&]( auto& m ) {
+         m.trade_capacity = capacity;
+      });
+   }
+
+
+   void exchange::setcandles( uint64_t market_id, std::vector<uint32_t> intervals ) {
+      require_auth( get_self() );
+
+      std::sort( intervals.begin(), intervals.end() );
+      check( std::unique( intervals.begin(), intervals.end() ) == intervals.end(), "duplicate candle interval" );
+      check( intervals.empty() || intervals.front() > 0, "candle interval must be positive" );
+
+      markets _markets( get_self(), get_self().value );
+      _markets.modify( _markets.get( market_id, "market does not exist" ), same_payer, [&]( auto& m ) {
+         m.candle_intervals = intervals;
+      });
+   }
+
+
+   void exchange::setfees( uint64_t market_id, uint16_t maker_fee, uint16_t taker_fee ) {
+      require_auth( get_self() );
+      check( maker_fee <= max_fee && taker_fee <= max_fee, "fee too high" );
+
+      markets _markets( get_self(), get_self().value );
+      _markets.modify( _markets.get( market_id, "market does not exist" ), same_payer, [&]( auto& m ) {
+         m.maker_fee = maker_fee;
+         m.taker_fee = taker_fee;
+      });
+   }
+
+
+   void exchange::claimfees( name to, std::vector<uint64_t> market_ids ) {
+      require_auth( get_self() );
+      check( is_account( to ), "to account does not exist" );
+
+      // markets sharing a token are paid out together
+      std::map<extended_symbol, int64_t> payouts;
+      for( uint64_t market_id : market_ids ) {
+         fee_pools _fee_pools( get_self(), market_id );
+         for( auto itr = _fee_pools.begin(); itr != _fee_pools.end(); ) {
+            payouts[itr->balance.get_extended_symbol()] += itr->balance.quantity.amount;
+            itr = _fee_pools.erase( itr );
+         }
+      }
+
+      for( const auto& p : payouts ) {
+         if( p.second == 0 )
+            continue;
+         token::transfer_action transfer_act( p.first.get_contract(), { get_self(), "active"_n } );
+         transfer_act.send( get_self(), to, asset( p.second, p.first.get_symbol() ), std::string("fees") );
+      }
+   }
+
+
+   void exchange::trade( name trader, uint64_t market_id, name order_type, asset price, asset volume, uint16_t max_fills,
+                         time_point_sec expiration, name time_in_force ) {
+      require_auth( trader );
+
+      markets _markets( get_self(), get_self().value );
+      market_book book( get_self(), _markets.get( market_id, "market does not exist" ), _accounts );
+
+      matching::expire_orders( book, expiry_sweep_budget );
+      _place_order( book, trader, order_type, price, volume, max_fills, expiration, time_in_force );
+   }
+
+
+   void exchange::placeorders( name trader, std::vector<order_spec> orders ) {
+      require_auth( trader );
+      check( !orders.empty(), "no orders to place" );
+
+      markets _markets( get_self(), get_self().value );
+      std::map<uint64_t, market_book> books;
+
+      for( const auto& spec : orders ) {
+         auto book = books.find( spec.market_id );
+         if( book == books.end() ) {
+            book = books.try_emplace( spec.market_id, get_self(), _markets.get( spec.market_id, "market does not exist" ), _accounts ).first;
+            matching::expire_orders( book->second, expiry_sweep_budget );
+         }
+
+         if( spec.replace_id != 0 ) {
+            _cancel_order( book->second, trader, spec.side, spec.replace_id );
+         }
+         _place_order( book->second, trader, spec.side, spec.price, spec.volume, spec.max_fills, spec.expiration, spec.time_in_force );
+      }
+   }
+
+
+   void exchange::cancelorder( name trader, uint64_t market_id, name side, uint64_t order_id ) {
+      require_auth( trader );
+
+      markets _markets( get_self(), get_self().value );
+      market_book book( get_self(), _markets.get( market_id, "market does not exist" ), _accounts );
+
+      _cancel_order( book, trader, side, order_id );
+   }
+
+
+   void exchange::cancelall( name trader, std::optional<uint64_t> market_id, uint16_t max ) {
+      require_auth( trader );
+
+      markets _markets( get_self(), get_self().value );
+      if( market_id ) {
+         market_book book( get_self(), _markets.get( *market_id, "market does not exist" ), _accounts );
+         matching::cancel_trader_orders( book, trader, max );
+         return;
+      }
+
+      // the trader's markets are read up front, the books rewrite them as they go
+      openorders _open( get_self(), trader.value );
+      std::vector<uint64_t> market_ids;
+      for( const auto& t : _open ) {
+         market_ids.push_back( t.market_id );
+      }
+
+      uint16_t cancelled = 0;
+      for( auto itr = market_ids.begin(); itr != market_ids.end() && cancelled < max; ++itr ) {
+         market_book book( get_self(), _markets.get( *itr, "market does not exist" ), _accounts );
+         cancelled += matching::cancel_trader_orders( book, trader, max - cancelled );
+      }
+   }
+
+
+   void exchange::match( uint64_t market_id, uint16_t max ) {
+      markets _markets( get_self(), get_self().value );
+      market_book book( get_self(), _markets.get( market_id, "market does not exist" ), _accounts );
+
+      const uint16_t expired = matching::expire_orders( book, expiry_sweep_budget );
+      check( expired > 0 || book.pending.begin() != book.pending.end(), "nothing to match" );
+
+      matching::resume_cursors( book, max );
+   }
+
+
+   void exchange::expire( uint16_t max ) {
+      markets _markets( get_self(), get_self().value );
+
+      uint16_t expired = 0;
+      for( auto itr = _markets.begin(); itr != _markets.end() && expired < max; ++itr ) {
+         market_book book( get_self(), *itr, _accounts );
+         expired += matching::expire_orders( book, max - expired );
+      }
+   }
+
+
+   /**
+    *  Looks a market up by its pair through the `bypair` index, skipping other pairs
+    *  that share the same key.
+    */
+   exchange::markets::const_iterator exchange::_find_market( const markets& _markets, const extended_symbol& base, const extended_symbol& quote ) {
+      auto idx = _markets.get_index<"bypair"_n>();
+      const uint128_t key = pair_key( base, quote );
+      for( auto itr = idx.lower_bound( key ); itr != idx.end() && itr->by_pair() == key; ++itr ) {
+         if( itr->base == base && itr->quote == quote )
+            return _markets.iterator_to( *itr );
+      }
+      return _markets.end();
+   }
+
+
+   void exchange::_place_order( market_book& book, name trader, name side, asset price, asset volume, uint16_t max_fills,
+                                time_point_sec expiration, name time_in_force ) {
+      const market& mkt = book.mkt;
+      const time_point_sec now( current_time_point() );
+      if( time_in_force == name() )
+         time_in_force = good_till_cancel;
+
+      check( side == bid_side || side == ask_side, "order type must be bid or ask" );
+      check( time_in_force == good_till_cancel || time_in_force == immediate_or_cancel
+             || time_in_force == fill_or_kill || time_in_force == post_only, "unknown time in force" );
+      check( price.symbol == mkt.base.get_symbol() && price.amount > 0, "invalid price" );
+      check( volume.symbol == mkt.quote.get_symbol() && volume.amount > 0, "invalid volume" );
+      check( !is_expired( expiration, now ), "order expiration must be in the future" );
+
+      match_cursor taker;
+      taker.id        = _next_order_id();
+      taker.trader    = trader;
+      taker.side      = side;
+      taker.price     = to_order_price( price, volume.symbol );
+      taker.volume    = volume;
+      taker.timestamp  = now;
+      taker.expiration = expiration;
+      taker.locked    = side == bid_side
+                      ? asset( matching::base_value( taker.price, volume.amount ), price.symbol )
+                      : volume;
+
+      const extended_symbol locked_sym = side == bid_side ? mkt.base : mkt.quote;
+      _accounts.adjust_balance( trader, extended_asset( -taker.locked.amount, locked_sym ) );
+
+      matching::time_in_force tif = matching::time_in_force::good_till_cancel;
+      if( time_in_force == immediate_or_cancel )
+         tif = matching::time_in_force::immediate_or_cancel;
+      else if( time_in_force == fill_or_kill )
+         tif = matching::time_in_force::fill_or_kill;
+      else if( time_in_force == post_only )
+         tif = matching::time_in_force::post_only;
+      matching::place_order( book, taker, max_fills, tif );
+   }
+
+
+   /**
+    *  Removes a resting order of `trader` from the book and releases its locked funds.
+    */
+   void exchange::_cancel_order( market_book& book, name trader, name side, uint64_t order_id ) {
+      check( side == bid_side || side == ask_side, "order type must be bid or ask" );
+      matching::cancel_order( book, trader, side == bid_side, order_id );
+   }
+
+
+   std::string_view exchange::next_memo_field( std::string_view& memo ) {
+      const auto end = memo.find( ':' );
+      const auto field = memo.substr( 0, end );
+      memo.remove_prefix( end == std::string_view::npos ? memo.size() : end + 1 );
+      return field;
+   }
+
+
+   uint64_t exchange::parse_memo_uint( std::string_view field ) {
+      check( !field.empty() && field.size() <= 19, "invalid number in memo" );
+
+      uint64_t value = 0;
+      for( char c : field ) {
+         check( c >= '0' && c <= '9', "invalid number in memo" );
+         value = value * 10 + uint64_t(c - '0');
+      }
+      return value;
+   }
+
+
+   int64_t exchange::parse_memo_amount( std::string_view field, symbol sym ) {
+      const auto dot = field.find( '.' );
+      const auto whole = field.substr( 0, dot );
+      const auto frac  = dot == std::string_view::npos ? std::string_view() : field.substr( dot + 1 );
+      check( frac.size() <= sym.precision(), "price has too many decimal places" );
+
+      uint128_t amount = parse_memo_uint( whole );
+      for( uint8_t p = 0; p < sym.precision(); ++p ) {
+         amount *= 10;
+         if( p < frac.size() ) {
+            check( frac[p] >= '0' && frac[p] <= '9', "invalid number in memo" );
+            amount += uint128_t(frac[p] - '0');
+         }
+      }
+      check( amount <= uint128_t(asset::max_amount), "price overflow" );
+      return int64_t(amount);
+   }
+
+
+   void exchange::_deposit_and_trade( name trader, const extended_asset& deposit, std::string_view memo ) {
+      const uint64_t   market_id   = parse_memo_uint( next_memo_field( memo ) );
+      const name       side        = name( next_memo_field( memo ) );
+      const auto       price_field = next_memo_field( memo );
+
+      // optional fill budget and time in force, in this order
+      uint64_t max_fills = default_memo_fills;
+      name     time_in_force;
+      if( !memo.empty() && memo[0] >= '0' && memo[0] <= '9' )
+         max_fills = parse_memo_uint( next_memo_field( memo ) );
+      if( !memo.empty() )
+         time_in_force = name( next_memo_field( memo ) );
+      check( memo.empty(), "unexpected memo field" );
+      check( max_fills <= std::numeric_limits<uint16_t>::max(), "fill budget too large" );
+
+      markets _markets( get_self(), get_self().value );
+      market_book book( get_self(), _markets.get( market_id, "market does not exist" ), _accounts );
+      const market& mkt = book.mkt;
+
+      const asset price( parse_memo_amount( price_field, mkt.base.get_symbol() ), mkt.base.get_symbol() );
+      check( price.amount > 0, "invalid price" );
+
+      asset volume;
+      if( side == bid_side ) {
+         check( deposit.get_extended_symbol() == mkt.base, "bids must be funded in the base asset" );
+         // the largest quote volume whose rounded up cost fits in the deposit
+         const order_price p = to_order_price( price, mkt.quote.get_symbol() );
+         const uint128_t v = uint128_t(deposit.quantity.amount) * p.quote / p.base;
+         volume = asset( int64_t(std::min( v, uint128_t(asset::max_amount) )), mkt.quote.get_symbol() );
+      } else {
+         check( side == ask_side, "order type must be bid or ask" );
+         check( deposit.get_extended_symbol() == mkt.quote, "asks must be funded in the quote asset" );
+         volume = deposit.quantity;
+      }
+      check( volume.amount > 0, "deposit too small for an order at this price" );
+
+      _accounts.adjust_balance( trader, deposit );
+      matching::expire_orders( book, expiry_sweep_budget );
+      _place_order( book, trader, side, price, volume, uint16_t(max_fills), time_point_sec(), time_in_force );
    }
 
 
@@ -39,16 +423,29 @@ namespace eosio {
       // if( code == _self )
       //    _excurrencies.on( t );
 
-      if ( memo.empty() || !memo.compare("deposit") || !memo.compare("withdraw") )
+      if( to != get_self() || from == get_self() )
          return;
 
-      if( to == get_self() ) {
-         auto a = extended_asset(quantity, name(memo));
-         check( a.quantity.is_valid(), "invalid quantity in transfer" );
-         check( a.quantity.amount != 0, "zero quantity is disallowed in transfer");
-         // _accounts.adjust_balance( from, a );
-         _adjust_balance( from, a );
+      const name token_contract = get_first_receiver();
+      check( _is_approved_token( token_contract ), "token contract is not approved" );
+      check( quantity.is_valid(), "invalid quantity in transfer" );
+      check( quantity.amount != 0, "zero quantity is disallowed in transfer");
+
+      const extended_asset deposit( quantity, token_contract );
+      std::string_view m( memo );
+      if( m.size() >= 2 && m[1] == ':' ) {
+         if( m[0] == 't' ) {
+            m.remove_prefix( 2 );
+            _deposit_and_trade( from, deposit, m );
+            return;
+         }
+         if( m[0] == 'd' && m.size() > 2 ) {
+            m.remove_prefix( 2 );
+            check( name( m ) == token_contract, "memo names a different token contract" );
+         }
       }
+
+      _accounts.adjust_balance( from, deposit );
    }
 
 
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <eosio/chain/config.hpp>
+#include <eosio/chain/trace.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <string>
+
+namespace eosio_system {
+
+/**
+ *  Costs of the actions applied by the testers' chains, grouped by action: every
+ *  action trace of a transaction, inline actions and notifications included, adds its
+ *  wall-clock `elapsed` and the RAM delta it billed to `contract::action`, or to
+ *  `contract::action>receiver` for a notification handled by `receiver`. Billed CPU
+ *  and NET are charged per transaction and go to its first action.
+ *
+ *  Profiling is enabled by the ACTION_PROFILE environment variable, naming the file the
+ *  min/avg/max summary table is written to when the test binary exits, or `-` for
+ *  stdout. While enabled, every transaction pushed through `eosio_system_tester` is
+ *  billed CPU objectively (see `objective_billing`) so receipts hold real usage.
+ */
+class action_profiler {
+public:
+   static action_profiler& instance() {
+      static action_profiler profiler;
+      return profiler;
+   }
+
+   bool enabled() const { return !_output.empty(); }
+
+   void record( const eosio::chain::transaction_trace_ptr& trace ) {
+      if( !enabled() || !trace || trace->action_traces.empty() )
+         return;
+
+      // the implicit onblock transaction of every block is not a tested action
+      const auto& first = trace->action_traces.front();
+      if( first.act.account == eosio::chain::config::system_account_name && first.act.name == N(onblock) )
+         return;
+
+      for( const auto& at : trace->action_traces ) {
+         std::string key = at.act.account.to_string() + "::" + at.act.name.to_string();
+         if( at.receiver != at.act.account )
+            key += ">" + at.receiver.to_string();
+         auto& c = _costs[key];
+
+         int64_t ram = 0;
+         for( const auto& delta : at.account_ram_deltas )
+            ram += delta.delta;
+
+         c.elapsed_us.add( at.elapsed.count() );
+         c.ram_bytes.add( ram );
+         if( &at == &first ) {
+            c.cpu_us.add( trace->receipt ? trace->receipt->cpu_usage_us : 0 );
+            c.net_bytes.add( trace->net_usage );
+         }
+      }
+   }
+
+   void write( FILE* out ) const {
+      fprintf( out, "%-44s %7s %26s %26s %26s %26s\n", "action", "count",
+               "elapsed us min/avg/max", "cpu us min/avg/max", "net bytes min/avg/max", "ram bytes min/avg/max" );
+      for( const auto& c : _costs ) {
+         fprintf( out, "%-44s %7llu %26s %26s %26s %26s\n", c.first.c_str(), (unsigned long long)c.second.elapsed_us.count,
+                  c.second.elapsed_us.str().c_str(), c.second.cpu_us.str().c_str(),
+                  c.second.net_bytes.str().c_str(), c.second.ram_bytes.str().c_str() );
+      }
+   }
+
+   ~action_profiler() {
+      if( !enabled() || _costs.empty() )
+         return;
+      if( _output == "-" ) {
+         write( stdout );
+         return;
+      }
+      if( FILE* out = fopen( _output.c_str(), "w" ) ) {
+         write( out );
+         fclose( out );
+      }
+   }
+
+private:
+   action_profiler() {
+      if( const char* output = getenv( "ACTION_PROFILE" ) )
+         _output = output;
+   }
+
+   struct metric {
+      uint64_t   count = 0;
+      int64_t    min   = std::numeric_limits<int64_t>::max();
+      int64_t    max   = std::numeric_limits<int64_t>::min();
+      int64_t    total = 0;
+
+      void add( int64_t v ) {
+         ++count;
+         min    = std::min( min, v );
+         max    = std::max( max, v );
+         total += v;
+      }
+
+      std::string str() const {
+         // inline actions and notifications never start a transaction
+         if( count == 0 )
+            return "-";
+         char buf[64];
+         snprintf( buf, sizeof(buf), "%lld/%lld/%lld", (long long)min, (long long)(total / int64_t(count)), (long long)max );
+         return buf;
+      }
+   };
+
+   struct costs {
+      metric   elapsed_us;
+      metric   cpu_us;
+      metric   net_bytes;
+      metric   ram_bytes;
+   };
+
+   std::string                    _output;
+   std::map<std::string, costs>   _costs;
+};
+
+} // namespace eosio_system
@@ -0,0 +1,275 @@
+/**
+ *  Native micro-benchmarks of the exchange's matching core (token.exchange/matching.hpp)
+ *  on the STL storage policy. Each workload drives synthetic order flow from a seeded
+ *  generator, times every operation and reports orders/sec, fills/sec and p50/p99
+ *  latency per operation.
+ *
+ *    matching_bench [--orders N] [--seed S] [--csv FILE]
+ */
+#include <token.exchange/stl_book.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace eosio;
+using namespace eosio::matching;
+
+namespace {
+
+   using clock = std::chrono::steady_clock;
+
+   // EOS(4)/BTC(8) style market: base units per whole quote unit
+   constexpr uint64_t whole_quote = 100000000;
+   constexpr uint64_t mid_price   = 8300000;
+   constexpr uint64_t tick        = 1000;
+   constexpr int64_t  funding     = int64_t(1) << 52;
+   constexpr uint64_t traders     = 100;
+
+   struct result {
+      std::string            workload;
+      uint64_t               ops = 0;
+      uint64_t               orders = 0;
+      uint64_t               fills = 0;
+      double                 seconds = 0;
+      std::vector<uint64_t>  latencies;   // nanoseconds per operation
+
+      double orders_per_sec() const { return seconds > 0 ? orders / seconds : 0; }
+      double fills_per_sec() const { return seconds > 0 ? fills / seconds : 0; }
+
+      uint64_t percentile( double p ) {
+         if( latencies.empty() )
+            return 0;
+         const size_t i = std::min( latencies.size() - 1, size_t( p * latencies.size() ) );
+         std::nth_element( latencies.begin(), latencies.begin() + i, latencies.end() );
+         return latencies[i];
+      }
+   };
+
+   /**
+    *  Times one operation and adds it to `r`.
+    */
+   template<typename F>
+   void timed( result& r, F&& op ) {
+      const auto start = clock::now();
+      op();
+      const auto end = clock::now();
+      r.latencies.push_back( std::chrono::duration_cast<std::chrono::nanoseconds>( end - start ).count() );
+      ++r.ops;
+   }
+
+   void fund( stl_book& book ) {
+      book.keep_fills = false;
+      for( uint64_t t = 1; t <= traders; ++t ) {
+         book.credit( t, true, funding );
+         book.credit( t, false, funding );
+      }
+   }
+
+   order_price at( uint64_t base ) { return order_price{ base, whole_quote }; }
+
+   /**
+    *  Random limit orders of random traders on both sides, priced uniformly within
+    *  50 ticks of the mid price, so about half of them cross.
+    */
+   result uniform_flow( uint64_t orders, std::mt19937_64& rng ) {
+      result r{};
+      r.workload = "uniform_limit_flow";
+      stl_book book;
+      fund( book );
+
+      std::uniform_int_distribution<uint64_t> trader( 1, traders );
+      std::uniform_int_distribution<int>      offset( -50, 50 );
+      std::uniform_int_distribution<int64_t>  volume( 1, 10 );
+      std::bernoulli_distribution             side( 0.5 );
+
+      const auto start = clock::now();
+      for( uint64_t i = 0; i < orders; ++i ) {
+         const auto t = trader( rng );
+         const bool bid = side( rng );
+         const auto price = at( mid_price + offset( rng ) * tick );
+         const auto vol = volume( rng ) * int64_t(whole_quote / 10);
+         timed( r, [&] { book.place( t, bid, price, vol, 20 ); } );
+      }
+      r.seconds = std::chrono::duration<double>( clock::now() - start ).count();
+      r.orders  = orders;
+      r.fills   = book.fill_count;
+      return r;
+   }
+
+   /**
+    *  A deep one-sided book of asks swept by large bids that each take up to 100
+    *  levels. The book is refilled between sweeps outside the timed operations, and
+    *  only the sweeps count as orders.
+    */
+   result one_sided_sweeps( uint64_t orders, std::mt19937_64& rng ) {
+      result r{};
+      r.workload = "one_sided_sweeps";
+      stl_book book;
+      fund( book );
+
+      std::uniform_int_distribution<uint64_t> trader( 1, traders );
+      std::uniform_int_distribution<int>      levels( 10, 100 );
+      constexpr int depth = 1000;
+
+      double seconds = 0;
+      while( r.orders < orders ) {
+         if( book.order_count( false ) < size_t(depth / 2) ) {
+            for( int i = 0; i < depth; ++i )
+               book.place( trader( rng ), false, at( mid_price + i * tick ), int64_t(whole_quote), 1 );
+         }
+
+         const int take = levels( rng );
+         const auto price = at( mid_price + depth * tick );
+         const auto fills_before = book.fill_count;
+         const auto start = clock::now();
+         timed( r, [&] {
+            book.place( trader( rng ), true, price, take * int64_t(whole_quote), uint16_t(take), time_in_force::immediate_or_cancel );
+         } );
+         seconds += std::chrono::duration<double>( clock::now() - start ).count();
+         r.fills += book.fill_count - fills_before;
+         ++r.orders;
+      }
+      r.seconds = seconds;
+      return r;
+   }
+
+   /**
+    *  Resting orders that never cross, cancelled about as fast as they are placed:
+    *  once the book holds 1000 orders, nine out of ten operations cancel a random
+    *  live order.
+    */
+   result cancel_churn( uint64_t orders, std::mt19937_64& rng ) {
+      result r{};
+      r.workload = "cancel_churn";
+      stl_book book;
+      fund( book );
+
+      std::uniform_int_distribution<uint64_t> trader( 1, traders );
+      std::uniform_int_distribution<int>      offset( 1, 200 );
+      std::uniform_int_distribution<int>      action( 0, 9 );
+      std::bernoulli_distribution             side( 0.5 );
+
+      struct live { uint64_t id; uint64_t trader; bool bid; };
+      std::vector<live> book_orders;
+
+      uint64_t placed = 0;
+      const auto start = clock::now();
+      while( placed < orders ) {
+         if( book_orders.size() >= 1000 && action( rng ) != 0 ) {
+            std::uniform_int_distribution<size_t> pick( 0, book_orders.size() - 1 );
+            const size_t i = pick( rng );
+            const live o = book_orders[i];
+            book_orders[i] = book_orders.back();
+            book_orders.pop_back();
+            timed( r, [&] { cancel_order( book, o.trader, o.bid, o.id ); } );
+            continue;
+         }
+         const auto t = trader( rng );
+         const bool bid = side( rng );
+         const auto price = at( bid ? mid_price - offset( rng ) * tick : mid_price + offset( rng ) * tick );
+         uint64_t id = 0;
+         timed( r, [&] { id = book.place( t, bid, price, int64_t(whole_quote), 20 ); } );
+         book_orders.push_back( { id, t, bid } );
+         ++placed;
+      }
+      r.seconds = std::chrono::duration<double>( clock::now() - start ).count();
+      r.orders  = placed;
+      r.fills   = book.fill_count;
+      return r;
+   }
+
+   /**
+    *  Uniform flow spread over 1000 markets, so every book stays a handful of orders
+    *  deep and each operation lands on a cold market.
+    */
+   result many_markets( uint64_t orders, std::mt19937_64& rng ) {
+      result r{};
+      r.workload = "many_markets_few_orders";
+      std::vector<stl_book> books( 1000 );
+      for( auto& book : books )
+         fund( book );
+
+      std::uniform_int_distribution<size_t>   market( 0, books.size() - 1 );
+      std::uniform_int_distribution<uint64_t> trader( 1, traders );
+      std::uniform_int_distribution<int>      offset( -5, 5 );
+      std::bernoulli_distribution             side( 0.5 );
+
+      const auto start = clock::now();
+      for( uint64_t i = 0; i < orders; ++i ) {
+         auto& book = books[market( rng )];
+         const auto t = trader( rng );
+         const bool bid = side( rng );
+         const auto price = at( mid_price + offset( rng ) * tick );
+         timed( r, [&] { book.place( t, bid, price, int64_t(whole_quote), 20 ); } );
+      }
+      r.seconds = std::chrono::duration<double>( clock::now() - start ).count();
+      r.orders  = orders;
+      for( const auto& book : books )
+         r.fills += book.fill_count;
+      return r;
+   }
+
+} // namespace
+
+
+int main( int argc, char** argv ) {
+   uint64_t orders = 1000000;
+   uint64_t seed   = 1;
+   const char* csv = nullptr;
+
+   for( int i = 1; i < argc; ++i ) {
+      if( !strcmp( argv[i], "--orders" ) && i + 1 < argc ) {
+         orders = strtoull( argv[++i], nullptr, 10 );
+      } else if( !strcmp( argv[i], "--seed" ) && i + 1 < argc ) {
+         seed = strtoull( argv[++i], nullptr, 10 );
+      } else if( !strcmp( argv[i], "--csv" ) && i + 1 < argc ) {
+         csv = argv[++i];
+      } else {
+         fprintf( stderr, "usage: %s [--orders N] [--seed S] [--csv FILE]\n", argv[0] );
+         return 1;
+      }
+   }
+
+   const std::vector<std::function<result( uint64_t, std::mt19937_64& )>> workloads{
+      uniform_flow, one_sided_sweeps, cancel_churn, many_markets
+   };
+
+   FILE* out = nullptr;
+   if( csv ) {
+      out = fopen( csv, "w" );
+      if( !out ) {
+         fprintf( stderr, "cannot open %s\n", csv );
+         return 1;
+      }
+      fprintf( out, "workload,ops,orders,fills,seconds,orders_per_sec,fills_per_sec,p50_ns,p99_ns\n" );
+   }
+
+   printf( "%-26s %10s %10s %10s %14s %14s %9s %9s\n",
+           "workload", "ops", "orders", "fills", "orders/sec", "fills/sec", "p50 ns", "p99 ns" );
+   for( const auto& workload : workloads ) {
+      std::mt19937_64 rng( seed );
+      result r = workload( orders, rng );
+      const uint64_t p50 = r.percentile( 0.50 );
+      const uint64_t p99 = r.percentile( 0.99 );
+
+      printf( "%-26s %10llu %10llu %10llu %14.0f %14.0f %9llu %9llu\n", r.workload.c_str(),
+              (unsigned long long)r.ops, (unsigned long long)r.orders, (unsigned long long)r.fills,
+              r.orders_per_sec(), r.fills_per_sec(), (unsigned long long)p50, (unsigned long long)p99 );
+      if( out ) {
+         fprintf( out, "%s,%llu,%llu,%llu,%.6f,%.0f,%.0f,%llu,%llu\n", r.workload.c_str(),
+                  (unsigned long long)r.ops, (unsigned long long)r.orders, (unsigned long long)r.fills,
+                  r.seconds, r.orders_per_sec(), r.fills_per_sec(), (unsigned long long)p50, (unsigned long long)p99 );
+      }
+   }
+
+   if( out )
+      fclose( out );
+   return 0;
+}
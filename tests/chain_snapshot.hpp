@@ -0,0 +1,136 @@
+#pragma once
+
+#include <eosio/chain/controller.hpp>
+#include <eosio/chain/snapshot.hpp>
+#include <fc/crypto/sha256.hpp>
+#include <fc/filesystem.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#ifndef CHAIN_SNAPSHOT_DIR
+#define CHAIN_SNAPSHOT_DIR "snapshots"
+#endif
+
+namespace eosio_system {
+
+/**
+ *  Chain states of the test fixtures, built once and restored from snapshots.
+ *
+ *  A fixture names its state by a kind and a digest of everything the state is built
+ *  from (see `digest`). The first fixture to build a state saves it as a binary
+ *  snapshot, CHAIN_SNAPSHOT_DIR/<kind>-<digest>.snapshot, and every later fixture of
+ *  the same kind and digest restores that snapshot instead of replaying the setup, in
+ *  this run and in the following ones. Rebuilt contracts or a rebuilt test binary
+ *  change the digest, so a stale snapshot is never restored; bump `version` when a
+ *  fixture's setup changes in a way neither of them shows.
+ *
+ *  Setting the NO_CHAIN_SNAPSHOT environment variable builds every state from genesis.
+ */
+class chain_snapshots {
+public:
+   static constexpr uint32_t version = 1;
+
+   static bool enabled() { return getenv( "NO_CHAIN_SNAPSHOT" ) == nullptr; }
+
+   /**
+    *  Digest of the build inputs of a state: the snapshot version, the running test
+    *  binary, which holds the setup code, and the code and ABIs the setup deploys.
+    */
+   template<typename... Blobs>
+   static fc::sha256 digest( const Blobs&... blobs ) {
+      fc::sha256::encoder enc;
+      enc.write( reinterpret_cast<const char*>( &version ), sizeof(version) );
+      const auto& exe = binary();
+      enc.write( exe.data(), exe.data_size() );
+      ( enc.write( reinterpret_cast<const char*>( blobs.data() ), blobs.size() ), ... );
+      return enc.result();
+   }
+
+   /**
+    *  The snapshot of `kind` built from `inputs`, or nullptr when there is none yet.
+    */
+   static const std::string* find( const std::string& kind, const fc::sha256& inputs ) {
+      if( !enabled() )
+         return nullptr;
+
+      auto& cache = snapshots();
+      const auto path = file( kind, inputs );
+      auto itr = cache.find( path );
+      if( itr == cache.end() ) {
+         std::ifstream in( path, std::ios::binary );
+         if( !in )
+            return nullptr;
+         std::ostringstream data;
+         data << in.rdbuf();
+         itr = cache.emplace( path, data.str() ).first;
+      }
+      return &itr->second;
+   }
+
+   /**
+    *  Writes the state of `chain` as the snapshot of `kind`. The chain must have no
+    *  pending block. The file is written under a temporary name and renamed, so
+    *  concurrent test processes only ever see complete snapshots.
+    */
+   static void save( const std::string& kind, const fc::sha256& inputs, eosio::chain::controller& chain ) {
+      if( !enabled() )
+         return;
+
+      std::ostringstream out;
+      auto writer = std::make_shared<eosio::chain::ostream_snapshot_writer>( out );
+      chain.write_snapshot( writer );
+      writer->finalize();
+
+      const auto path = file( kind, inputs );
+      snapshots()[path] = out.str();
+
+      fc::create_directories( fc::path( CHAIN_SNAPSHOT_DIR ) );
+      const auto temp = path + ".tmp." + std::to_string( getpid() );
+      {
+         std::ofstream f( temp, std::ios::binary | std::ios::trunc );
+         f << snapshots()[path];
+      }
+      std::rename( temp.c_str(), path.c_str() );
+   }
+
+   /**
+    *  A reader of `snapshot`, reading from `stream`.
+    */
+   static eosio::chain::snapshot_reader_ptr reader( std::istringstream& stream, const std::string& snapshot ) {
+      stream.str( snapshot );
+      return std::make_shared<eosio::chain::istream_snapshot_reader>( stream );
+   }
+
+private:
+   /**
+    *  Hash of the running executable, read once per process.
+    */
+   static const fc::sha256& binary() {
+      static const fc::sha256 hash = [] {
+         fc::sha256::encoder enc;
+         std::ifstream exe( "/proc/self/exe", std::ios::binary );
+         char buf[1 << 16];
+         while( exe.read( buf, sizeof(buf) ) || exe.gcount() > 0 )
+            enc.write( buf, exe.gcount() );
+         return enc.result();
+      }();
+      return hash;
+   }
+
+   static std::map<std::string, std::string>& snapshots() {
+      static std::map<std::string, std::string> cache;
+      return cache;
+   }
+
+   static std::string file( const std::string& kind, const fc::sha256& inputs ) {
+      return std::string( CHAIN_SNAPSHOT_DIR ) + "/" + kind + "-" + inputs.str() + ".snapshot";
+   }
+};
+
+} // namespace eosio_system
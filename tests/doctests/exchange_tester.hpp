@@ -0,0 +1,433 @@
+#pragma once
+
+#include "doctest.h"
+
+#include <eosio/testing/tester.hpp>
+#include <eosio/chain/abi_serializer.hpp>
+#include <eosio/chain/resource_limits.hpp>
+
+#include "../contracts.hpp"
+#include "../eosio.system_tester.hpp"
+
+using namespace eosio::chain;
+using namespace eosio::testing;
+using namespace fc;
+
+using mvo = fc::mutable_variant_object;
+
+#define CONTRACT_ACCOUNT name("exchange")
+
+namespace eosio {
+   namespace chain {
+      // Add this in symbol.hpp (line 172)
+      inline bool operator== (const extended_symbol& lhs, const extended_symbol& rhs)
+      {
+         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) == ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
+      }
+      inline bool operator!= (const extended_symbol& lhs, const extended_symbol& rhs)
+      {
+         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) != ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
+      }
+      inline bool operator< (const extended_symbol& lhs, const extended_symbol& rhs)
+      {
+         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) < ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
+      }
+      inline bool operator> (const extended_symbol& lhs, const extended_symbol& rhs)
+      {
+         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) > ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
+      }
+   }
+}
+
+namespace eosio_system {
+
+   /**
+    *  Chain fixture of the token.exchange doctest suites: a system chain with the
+    *  exchange and exchange.results contracts deployed, an EOS token and helpers for
+    *  the exchange's actions and tables.
+    */
+   class exchange_tester : public eosio_system_tester {
+   public:
+      friend inline bool operator< (const extended_symbol& lhs, const extended_symbol& rhs);
+
+      static inline name exchange_account = CONTRACT_ACCOUNT;
+      static inline name results_account  = name("exch.results");
+      exchange_tester()
+         : eosio_system_tester(chain_snapshots::find("exchange", snapshot_inputs()) ? setup_level::none : setup_level::full) {
+         if (const auto* snapshot = chain_snapshots::find("exchange", snapshot_inputs())) {
+            restore_snapshot(*snapshot);
+            load_abis();
+            eos_token = token(this, name("eosio.token"), symbol(4,"EOS"));
+            return;
+         }
+         deploy_contract();
+         save_snapshot("exchange", snapshot_inputs());
+      }
+
+      /**
+       *  Build inputs of the chain with the exchange deployed, see `chain_snapshots`
+       */
+      static const fc::sha256& snapshot_inputs() {
+         static const fc::sha256 inputs = chain_snapshots::digest(
+             eosio_system_tester::snapshot_inputs().str(), contracts::exchange_wasm(), contracts::exchange_abi(),
+             contracts::exchange_results_wasm(), contracts::exchange_results_abi());
+         return inputs;
+      }
+
+      /**
+       *  Lists market 1, trading BTC against EOS, with alice holding 10000 EOS and bob
+       *  10 BTC on the exchange. BTC is a second eosio.token symbol.
+       */
+      void setup_btc_eos_market() {
+         const symbol eos_sym(4, "EOS");
+         const symbol btc_sym(8, "BTC");
+         token btc_token(this, name("eosio.token"), asset(2100000000000000, btc_sym));
+         btc_token.issue(name("eosio.token"), asset(2100000000000000, btc_sym));
+
+         create_account_with_resources(name("alice"), config::system_account_name, 1000000);
+         create_account_with_resources(name("bob"), config::system_account_name, 1000000);
+         transfer(name("eosio.token"), name("alice"), asset(100000000, eos_sym), "memo");
+         transfer(name("eosio.token"), name("bob"), asset(1000000000, btc_sym), "memo");
+         REQUIRE(success() == transfer(name("alice"), exchange_account, asset(100000000, eos_sym), "eosio.token"));
+         REQUIRE(success() == transfer(name("bob"), exchange_account, asset(1000000000, btc_sym), "eosio.token"));
+
+         REQUIRE(success() == createmarket(extended_symbol{eos_sym, name("eosio.token")}, extended_symbol{btc_sym, name("eosio.token")}));
+      }
+
+      abi_serializer deploy_code(name account, const std::vector<uint8_t>& wasm, const std::vector<char>& abiname) {
+         set_code(account, wasm);
+         set_abi(account, abiname.data());
+
+         produce_blocks();
+         const auto& accnt = control->db().get<account_object, by_name>(account);
+
+         abi_serializer abi_ser;
+         abi_def        abi;
+         REQUIRE(abi_serializer::to_abi(accnt.abi, abi));
+         abi_ser.set_abi(abi, abi_serializer_max_time);
+         return abi_ser;
+      }
+
+      void deploy_contract() {
+         // create_account(exchange_account);
+         create_account_with_resources(exchange_account, config::system_account_name, 1000000);
+         produce_blocks(2);
+         deploy_code(exchange_account, contracts::exchange_wasm(), contracts::exchange_abi());
+         create_account_with_resources(results_account, config::system_account_name, 1000000);
+         deploy_code(results_account, contracts::exchange_results_wasm(), contracts::exchange_results_abi());
+
+         eos_token = token(this, name("eosio.token"), asset(10000000000000, symbol(4,"EOS")));
+         eos_token.issue(name("eosio.token"), asset(10000000000000, symbol(4,"EOS")));
+
+         add_code_permission(exchange_account);
+         REQUIRE(success() == addtoken(name("eosio.token")));
+      }
+
+      action_result push_action_ex(account_name actor, const name& code, const action_name& acttype, const variant_object& data) {
+         return push_action(get_action(code, acttype, {permission_level{actor, config::active_name}}, data), uint64_t(actor));
+      }
+
+      action_result push_action_ex(const std::vector<permission_level>& perms,
+                                   const name&                          code,
+                                   const action_name&                   acttype,
+                                   const variant_object&                data,
+                                   const std::vector<permission_level>& signers) {
+         signed_transaction trx;
+         trx.actions.emplace_back(get_action(code, acttype, perms, data));
+         set_transaction_headers(trx);
+         for (const auto& auth : signers) {
+            trx.sign(get_private_key(auth.actor, auth.permission.to_string()), control->get_chain_id());
+         }
+         try {
+            // print_action_console(push_transaction(trx));
+            push_transaction(trx);
+         } catch (const fc::exception& ex) {
+            edump((ex.to_detail_string()));
+            return error(ex.top_message()); // top_message() is assumed by many tests; otherwise they fail
+            // return error(ex.to_detail_string());
+         }
+         produce_block();
+         BOOST_REQUIRE_EQUAL(true, chain_has_transaction(trx.id()));
+         return success();
+      }
+
+      /*
+      *  Helper Functions
+      */
+
+      void add_code_permission(name account) {
+         const auto priv_key = this->get_private_key(account.to_string(), "active");
+         const auto pub_key  = priv_key.get_public_key();
+
+         this->set_authority(account, name("active"), authority(1, {key_weight{pub_key, 1}}, {{permission_level{account, name("eosio.code")}, 1}}),
+                             "owner");
+      }
+
+      transaction make_transaction(const fc::variants& actions) {
+         variant pretty_trx = fc::mutable_variant_object()("expiration", "2020-01-01T00:30")("ref_block_num", 2)("ref_block_prefix", 3)(
+             "max_net_usage_words", 0)("max_cpu_usage_ms", 0)("delay_sec", 0)("actions", actions);
+         transaction trx;
+         abi_serializer::from_variant(pretty_trx, trx, get_resolver(), abi_serializer_max_time);
+         return trx;
+      }
+
+      transaction make_transaction(vector<action>&& actions) {
+         transaction trx;
+         trx.actions = std::move(actions);
+         set_transaction_headers(trx);
+         return trx;
+      }
+
+      transaction
+      make_transaction_with_data(account_name code, name action, const vector<permission_level>& perms, const fc::variant& data) {
+         return make_transaction({fc::mutable_variant_object()("account", code)("name", action)("authorization", perms)("data", data)});
+      }
+
+      /*
+      *  Contract Actions
+      */
+
+      action_result transfer(name from, name to, const asset& amount, std::string memo) {
+         return push_action_ex(from, name("eosio.token"), name("transfer"),
+                               mutable_variant_object()("from", from)("to", to)("quantity", amount)("memo", memo));
+      }
+
+      action_result addtoken(name contract) {
+         return push_action_ex(CONTRACT_ACCOUNT, CONTRACT_ACCOUNT, name("addtoken"), mutable_variant_object()("contract", contract));
+      }
+
+      action_result removetoken(name contract) {
+         return push_action_ex(CONTRACT_ACCOUNT, CONTRACT_ACCOUNT, name("removetoken"), mutable_variant_object()("contract", contract));
+      }
+
+      action_result createmarket(const extended_symbol& base, const extended_symbol& quote) {
+         return push_action_ex(CONTRACT_ACCOUNT, CONTRACT_ACCOUNT, name("createmarket"),
+                               mutable_variant_object()("base", base)("quote", quote));
+      }
+
+      action_result settradecap(uint64_t market_id, uint16_t capacity) {
+         return push_action_ex(CONTRACT_ACCOUNT, CONTRACT_ACCOUNT, name("settradecap"),
+                               mutable_variant_object()("market_id", market_id)("capacity", capacity));
+      }
+
+      action_result withdraw(name from, const extended_asset& quantity) {
+         return push_action_ex(from, CONTRACT_ACCOUNT, name("withdraw"),
+                               mutable_variant_object()("from", from)("quantity", quantity));
+      }
+
+      action_result withdrawall(name owner, const fc::variant& tokens) {
+         return push_action_ex(owner, CONTRACT_ACCOUNT, name("withdrawall"),
+                               mutable_variant_object()("owner", owner)("tokens", tokens));
+      }
+
+      action_result migrate(name owner) {
+         return push_action_ex(owner, CONTRACT_ACCOUNT, name("migrate"), mutable_variant_object()("owner", owner));
+      }
+
+      /**
+       *  Deposits `quantity` of `owner` the way the legacy exchange did, into an `exaccounts` row:
+       *  the legacy contract is deployed for the transfer and the current one put back after it.
+       *  The legacy contract bills the row to `owner` from the transfer notification, which only
+       *  a privileged contract may do, so the exchange is privileged for the deposit.
+       */
+      void legacy_deposit(name owner, const asset& quantity) {
+         push_action(config::system_account_name, name("setpriv"), config::system_account_name,
+                     mutable_variant_object()("account", exchange_account)("is_priv", 1));
+         set_code(exchange_account, contracts::util::exchange_wasm());
+         REQUIRE(success() == transfer(owner, exchange_account, quantity, "deposit"));
+         set_code(exchange_account, contracts::exchange_wasm());
+         push_action(config::system_account_name, name("setpriv"), config::system_account_name,
+                     mutable_variant_object()("account", exchange_account)("is_priv", 0));
+         produce_blocks();
+      }
+
+      bool has_legacy_account(name owner) {
+         return !get_row_by_account(CONTRACT_ACCOUNT, owner, name("exaccounts"), owner).empty();
+      }
+
+      action_result setfees(uint64_t market_id, uint16_t maker_fee, uint16_t taker_fee) {
+         return push_action_ex(CONTRACT_ACCOUNT, CONTRACT_ACCOUNT, name("setfees"),
+                               mutable_variant_object()("market_id", market_id)("maker_fee", maker_fee)("taker_fee", taker_fee));
+      }
+
+      action_result claimfees(name to, const std::vector<uint64_t>& market_ids) {
+         return push_action_ex(CONTRACT_ACCOUNT, CONTRACT_ACCOUNT, name("claimfees"),
+                               mutable_variant_object()("to", to)("market_ids", market_ids));
+      }
+
+      action_result trade(name trader, uint64_t market_id, name order_type, const asset& price, const asset& volume,
+                          uint16_t max_fills, time_point_sec expiration = time_point_sec(), name time_in_force = name()) {
+         return push_action_ex(trader, CONTRACT_ACCOUNT, name("trade"),
+                               mutable_variant_object()("trader", trader)("market_id", market_id)("order_type", order_type)
+                                                       ("price", price)("volume", volume)("max_fills", max_fills)
+                                                       ("expiration", expiration)("time_in_force", time_in_force));
+      }
+
+      std::vector<fc::variant> get_trade_fills(name trader, uint64_t market_id, name order_type, const asset& price,
+                                               const asset& volume, uint16_t max_fills) {
+         auto trace = push_action(CONTRACT_ACCOUNT, name("trade"), trader,
+                                  mvo()("trader", trader)("market_id", market_id)("order_type", order_type)
+                                       ("price", price)("volume", volume)("max_fills", max_fills)
+                                       ("expiration", time_point_sec())("time_in_force", name()));
+         abi_serializer results_ser(control->get_account(results_account).get_abi(), abi_serializer_max_time);
+         std::vector<fc::variant> fills;
+         for (const auto& at : trace->action_traces) {
+            if (at.receiver == results_account && at.act.name == name("fill")) {
+               fills.push_back(results_ser.binary_to_variant("fill", at.act.data, abi_serializer_max_time));
+            }
+         }
+         return fills;
+      }
+
+      action_result placeorders(name trader, const fc::variants& orders) {
+         return push_action_ex(trader, CONTRACT_ACCOUNT, name("placeorders"),
+                               mutable_variant_object()("trader", trader)("orders", orders));
+      }
+
+      action_result cancelorder(name trader, uint64_t market_id, name side, uint64_t order_id) {
+         return push_action_ex(trader, CONTRACT_ACCOUNT, name("cancelorder"),
+                               mutable_variant_object()("trader", trader)("market_id", market_id)("side", side)("order_id", order_id));
+      }
+
+      action_result cancelall(name trader, const fc::variant& market_id, uint16_t max) {
+         return push_action_ex(trader, CONTRACT_ACCOUNT, name("cancelall"),
+                               mutable_variant_object()("trader", trader)("market_id", market_id)("max", max));
+      }
+
+      action_result match(name actor, uint64_t market_id, uint16_t max) {
+         return push_action_ex(actor, CONTRACT_ACCOUNT, name("match"),
+                               mutable_variant_object()("market_id", market_id)("max", max));
+      }
+
+      action_result expire(name actor, uint16_t max) {
+         return push_action_ex(actor, CONTRACT_ACCOUNT, name("expire"), mutable_variant_object()("max", max));
+      }
+
+      /*
+      *  TABLES
+      */
+
+      abi_serializer get_serializer() {
+         const auto& acnt = control->get_account(CONTRACT_ACCOUNT);
+         auto        abi  = acnt.get_abi();
+         return abi_serializer(abi, abi_serializer_max_time);
+      }
+
+      fc::variant get_order(uint64_t market_id, name table, uint64_t id) {
+         vector<char> data = get_row_by_account(CONTRACT_ACCOUNT, name(market_id), table, name(id));
+         return data.empty() ? fc::variant() : get_serializer().binary_to_variant("order", data, abi_serializer_max_time);
+      }
+
+      fc::variant get_cursor(uint64_t market_id, uint64_t id) {
+         vector<char> data = get_row_by_account(CONTRACT_ACCOUNT, name(market_id), name("cursors"), name(id));
+         return data.empty() ? fc::variant() : get_serializer().binary_to_variant("match_cursor", data, abi_serializer_max_time);
+      }
+
+      /**
+       *  The `askdepth` or `biddepth` level of `price`; bid levels are keyed by the inverted price
+       */
+      fc::variant get_level(uint64_t market_id, name table, const asset& price) {
+         const uint64_t key = table == name("biddepth") ? std::numeric_limits<uint64_t>::max() - uint64_t(price.get_amount())
+                                                        : uint64_t(price.get_amount());
+         vector<char> data = get_row_by_account(CONTRACT_ACCOUNT, name(market_id), table, name(key));
+         return data.empty() ? fc::variant() : get_serializer().binary_to_variant("price_level", data, abi_serializer_max_time);
+      }
+
+      uint32_t get_open_orders(name trader, uint64_t market_id) {
+         vector<char> data = get_row_by_account(CONTRACT_ACCOUNT, trader, name("openorders"), name(market_id));
+         return data.empty() ? 0 : get_serializer().binary_to_variant("trader_market", data, abi_serializer_max_time)["orders"].as<uint32_t>();
+      }
+
+      fc::variant get_recent_trade(uint64_t market_id, uint64_t slot) {
+         vector<char> data = get_row_by_account(CONTRACT_ACCOUNT, name(market_id), name("recenttrades"), name(slot));
+         return data.empty() ? fc::variant() : get_serializer().binary_to_variant("trade_record", data, abi_serializer_max_time);
+      }
+
+      fc::variant get_candle(uint64_t market_id, uint32_t interval, uint32_t start) {
+         const uint64_t key = (uint64_t(interval) << 32) | start;
+         vector<char> data = get_row_by_account(CONTRACT_ACCOUNT, name(market_id), name("candles"), name(key));
+         return data.empty() ? fc::variant() : get_serializer().binary_to_variant("candle", data, abi_serializer_max_time);
+      }
+
+      int64_t get_exchange_balance(account_name acc, const extended_symbol& sym) {
+         const auto& db = control->db();
+         const auto* t_id = db.find<table_id_object, by_code_scope_table>(boost::make_tuple(CONTRACT_ACCOUNT, acc, name("exbalances")));
+         if (!t_id) {
+            return 0;
+         }
+
+         const auto& idx = db.get_index<key_value_index, by_scope_primary>();
+         for (auto itr = idx.lower_bound(boost::make_tuple(t_id->id, 0)); itr != idx.end() && itr->t_id == t_id->id; ++itr) {
+            vector<char> data(itr->value.data(), itr->value.data() + itr->value.size());
+            auto balance = get_serializer().binary_to_variant("exbalance", data, abi_serializer_max_time)["balance"].as<extended_asset>();
+            if (balance.quantity.get_symbol() == sym.sym && balance.contract == sym.contract) {
+               return balance.quantity.get_amount();
+            }
+         }
+         return 0;
+      }
+
+      /*
+      *  eosio.token Contract Interface
+      */
+
+      struct token {
+         exchange_tester* tester_;
+         name           issuer_;
+         symbol         sym_;
+
+         token() {}
+
+         /**
+          *  A token created earlier, e.g. in a restored snapshot
+          */
+         token(exchange_tester* tester, name issuer, symbol sym)
+            : tester_(tester)
+            , issuer_(issuer)
+            , sym_(sym) {}
+
+         token(exchange_tester* tester, name issuer, asset max_supply)
+            : tester_(tester)
+            , issuer_(issuer)
+            , sym_(max_supply.get_symbol()) {
+            create_currency(name("eosio.token"), issuer_, max_supply);
+         }
+         
+         void create_currency( name contract, name issuer, asset maxsupply ) {
+            tester_->push_action_ex(issuer, name("eosio.token"), name("create"),
+                                    mutable_variant_object()("issuer", issuer)("maximum_supply", maxsupply));
+         }
+         void issue(name to, asset quantity, std::string memo = "") {
+            tester_->push_action_ex(issuer_, name("eosio.token"), name("issue"),
+                                    mutable_variant_object()("to", to)("quantity", quantity)("memo", memo));
+         }
+         void open(name owner, name ram_payer) {
+            REQUIRE(tester_->push_action_ex(ram_payer, name("eosio.token"), name("open"),
+                                            mutable_variant_object()("owner", owner)("symbol", sym_)("ram_payer", ram_payer)) ==
+                    tester_->success());
+         }
+         abi_serializer get_serializer() {
+            const auto& acnt = tester_->control->get_account(name("eosio.token"));
+            auto        abi  = acnt.get_abi();
+            return abi_serializer(abi, abi_serializer_max_time);
+         }
+
+         asset get_account_balance(account_name acc) {
+            auto         symbol_code = sym_.to_symbol_code().value;
+            vector<char> data        = tester_->get_row_by_account(name("eosio.token"), acc, name("accounts"), symbol_code);
+            return data.empty() ? asset(0, sym_)
+                                : get_serializer().binary_to_variant("account", data, abi_serializer_max_time)["balance"].as<asset>();
+         }
+
+         asset get_supply() {
+            auto         symbol_code = sym_.to_symbol_code().value;
+            vector<char> data        = tester_->get_row_by_account(name("eosio.token"), symbol_code, name("stat"), symbol_code);
+            return data.empty() ? asset(0, sym_)
+                                : get_serializer().binary_to_variant("currency_stats", data, abi_serializer_max_time)["supply"].as<asset>();
+         }
+      };
+
+      token eos_token;
+   };
+
+} // namespace eosio_system
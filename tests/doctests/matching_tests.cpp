@@ -0,0 +1,180 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+#include <token.exchange/stl_book.hpp>
+
+using namespace eosio;
+using namespace eosio::matching;
+
+namespace {
+   // EOS(4)/BTC(8): prices are EOS units per whole BTC
+   order_price eos_per_btc( uint64_t base ) { return order_price{ base, 100000000 }; }
+
+   constexpr uint64_t alice = 1;
+   constexpr uint64_t bob   = 2;
+   constexpr bool     base  = true;
+   constexpr bool     quote = false;
+}
+
+
+TEST_CASE( "native book matches at the maker's price" ) {
+
+   GIVEN( "two asks on the book" ) {
+
+      stl_book book;
+      book.credit( alice, base, 100000000 );
+      book.credit( bob, quote, 1000000000 );
+
+      book.place( bob, false, eos_per_btc( 8320000 ), 500000000, 10 );
+      book.place( bob, false, eos_per_btc( 8310000 ), 300000000, 10 );
+      REQUIRE( book.order_count( false ) == 2 );
+
+      WHEN( "alice bids through both levels" ) {
+
+         book.place( alice, true, eos_per_btc( 8320000 ), 400000000, 10 );
+
+         THEN( "the cheaper ask fills first and the rest of the bid fills at the second level" ) {
+            REQUIRE( book.fills.size() == 2 );
+            CHECK( book.fills[0].price.base == 8310000 );
+            CHECK( book.fills[0].volume == 300000000 );
+            CHECK( book.fills[1].price.base == 8320000 );
+            CHECK( book.fills[1].volume == 100000000 );
+
+            CHECK( book.balance( alice, quote ) == 400000000 );
+            CHECK( book.balance( alice, base ) == 100000000 - 24930000 - 8320000 );
+            CHECK( book.balance( bob, base ) == 24930000 + 8320000 );
+            CHECK( book.order_count( false ) == 1 );
+            CHECK( book.order_count( true ) == 0 );
+         }
+      }
+   }
+}
+
+
+TEST_CASE( "native book settles rounded fills against the taker's lock" ) {
+
+   stl_book book;
+   book.credit( alice, base, 100000000 );
+   book.credit( bob, quote, 1000000000 );
+
+   SUBCASE( "two asks whose values both round up" ) {
+      book.place( bob, false, eos_per_btc( 8310000 ), 50000001, 10 );
+      book.place( bob, false, eos_per_btc( 8310000 ), 50000001, 10 );
+      book.place( alice, true, eos_per_btc( 8310000 ), 100000002, 10 );
+
+      CHECK( book.fill_count == 2 );
+      CHECK( book.balance( alice, base ) == 100000000 - 8310001 );
+      CHECK( book.balance( bob, base ) == 8310001 );
+   }
+
+   SUBCASE( "asks of one unit each" ) {
+      book.place( bob, false, eos_per_btc( 8310000 ), 1, 10 );
+      book.place( bob, false, eos_per_btc( 8310000 ), 1, 10 );
+      book.place( alice, true, eos_per_btc( 8310000 ), 2, 10 );
+
+      CHECK( book.fill_count == 2 );
+      CHECK( book.balance( alice, base ) == 100000000 - 1 );
+      CHECK( book.balance( bob, base ) == 1 );
+   }
+
+   SUBCASE( "a remainder rests with the lock it needs" ) {
+      book.place( bob, false, eos_per_btc( 8310000 ), 1, 10 );
+      const uint64_t bid = book.place( alice, true, eos_per_btc( 8310000 ), 2, 10 );
+
+      CHECK( book.order_count( true ) == 1 );
+      CHECK( book.balance( alice, base ) == 100000000 - 1 );
+      CHECK( book.balance( bob, base ) == 0 );
+
+      cancel_order( book, alice, true, bid );
+      CHECK( book.balance( alice, base ) == 100000000 );
+   }
+
+   CHECK( book.balance( alice, base ) + book.balance( bob, base ) == 100000000 );
+}
+
+
+TEST_CASE( "native book parks what the fill budget leaves crossing" ) {
+
+   stl_book book;
+   book.credit( alice, base, 100000000 );
+   book.credit( bob, quote, 1000000000 );
+
+   for( int i = 0; i < 5; ++i )
+      book.place( bob, false, eos_per_btc( 8300000 + i * 1000 ), 100000000, 10 );
+
+   book.place( alice, true, eos_per_btc( 8310000 ), 500000000, 2 );
+   CHECK( book.fill_count == 2 );
+   CHECK( book.parked_count() == 1 );
+
+   // only orders that would take liquidity wait behind the parked one
+   book.place( alice, true, eos_per_btc( 8200000 ), 100000000, 0 );
+   CHECK( book.parked_count() == 1 );
+   CHECK( book.order_count( true ) == 1 );
+   book.place( alice, true, eos_per_btc( 8330000 ), 100000000, 0 );
+   CHECK( book.parked_count() == 2 );
+
+   // a parked order is cancelled like a resting one
+   const uint64_t late = book.place( alice, true, eos_per_btc( 8340000 ), 100000000, 0 );
+   CHECK( book.parked_count() == 3 );
+   CHECK_THROWS_WITH( cancel_order( book, bob, true, late ), "order belongs to another trader" );
+   CHECK_THROWS_WITH( cancel_order( book, alice, false, late ), "order does not exist" );
+   cancel_order( book, alice, true, late );
+   CHECK( book.parked_count() == 2 );
+
+   resume_cursors( book, 10 );
+   CHECK( book.fill_count == 5 );
+   CHECK( book.parked_count() == 0 );
+   CHECK( book.order_count( false ) == 0 );
+}
+
+
+TEST_CASE( "native book time in force" ) {
+
+   stl_book book;
+   book.credit( alice, base, 100000000 );
+   book.credit( bob, quote, 1000000000 );
+   book.place( bob, false, eos_per_btc( 8310000 ), 100000000, 10 );
+
+   CHECK_THROWS_WITH( book.place( alice, true, eos_per_btc( 8310000 ), 200000000, 10, time_in_force::fill_or_kill ),
+                      "fill-or-kill order cannot be filled in full" );
+   CHECK_THROWS_WITH( book.place( alice, true, eos_per_btc( 8310000 ), 100000000, 10, time_in_force::post_only ),
+                      "post-only order would cross the book" );
+
+   book.place( alice, true, eos_per_btc( 8310000 ), 200000000, 10, time_in_force::immediate_or_cancel );
+   CHECK( book.fill_count == 1 );
+   CHECK( book.order_count( true ) == 0 );
+   CHECK( book.balance( alice, base ) == 100000000 - 8310000 );
+}
+
+
+TEST_CASE( "native book cancels and expires orders" ) {
+
+   stl_book book;
+   book.credit( bob, quote, 1000000000 );
+   const uint64_t first = book.place( bob, false, eos_per_btc( 8310000 ), 100000000, 10 );
+   book.place( bob, false, eos_per_btc( 8320000 ), 100000000, 10, time_in_force::good_till_cancel, 100 );
+   book.place( bob, false, eos_per_btc( 8330000 ), 100000000, 10 );
+
+   CHECK_THROWS_WITH( cancel_order( book, alice, false, first ), "order belongs to another trader" );
+   cancel_order( book, bob, false, first );
+   CHECK( book.order_count( false ) == 2 );
+
+   book.now = 100;
+   CHECK( expire_orders( book, 10 ) == 1 );
+   CHECK( cancel_trader_orders( book, bob, 10 ) == 1 );
+   CHECK( book.order_count( false ) == 0 );
+   CHECK( book.levels.empty() );
+   CHECK( book.balance( bob, quote ) == 1000000000 );
+
+   // parked orders are cancelled after resting ones, within the same budget
+   book.credit( alice, base, 100000000 );
+   book.place( bob, false, eos_per_btc( 8310000 ), 100000000, 10 );
+   book.place( alice, true, eos_per_btc( 8310000 ), 200000000, 0 );
+   book.place( alice, true, eos_per_btc( 8200000 ), 100000000, 0 );
+   REQUIRE( book.parked_count() == 1 );
+   CHECK( cancel_trader_orders( book, alice, 1 ) == 1 );
+   CHECK( book.parked_count() == 1 );
+   CHECK( cancel_trader_orders( book, alice, 10 ) == 1 );
+   CHECK( book.parked_count() == 0 );
+   CHECK( book.balance( alice, base ) == 100000000 );
+}
@@ -1,304 +1,701 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
-#include <eosio/testing/tester.hpp>
-#include <eosio/chain/abi_serializer.hpp>
-#include <eosio/chain/resource_limits.hpp>
+#include "exchange_tester.hpp"
 
-#include "../contracts.hpp"
-#include "../eosio.system_tester.hpp"
 
-using namespace eosio::chain;
-using namespace eosio::testing;
-using namespace fc;
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "deposit") try {
+
+   GIVEN("alice has 5 EOS") {
+
+      create_account_with_resources(name("alice"), config::system_account_name, 1000000);
+      transfer(name("eosio.token"), name("alice"), asset(50000, symbol(4,"EOS")), "memo");
+
+      REQUIRE(eos_token.get_account_balance(name("alice")) == asset(50000, symbol(4,"EOS")));
 
-using mvo = fc::mutable_variant_object;
+      WHEN("alice deposits 2 EOS into the exchange") {
+
+         CHECK(success() == transfer(name("alice"), exchange_account, asset(20000, symbol(4,"EOS")), "eosio.token"));
 
-// #ifndef TESTER
-// #ifdef NON_VALIDATING_TEST
-// #define TESTER tester
-// #else
-// #define TESTER validating_tester
-// #endif
-// #endif
+         THEN("alice would have 2 EOS in her exchange account") {
+            CHECK(eos_token.get_account_balance(name("alice")) == asset(30000, symbol(4,"EOS")));
+            CHECK(eos_token.get_account_balance(exchange_account) == asset(20000, symbol(4,"EOS")));
 
-#define CONTRACT_ACCOUNT name("exchange")
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{symbol(4,"EOS"), name("eosio.token")}) == 20000);
+         }
 
-namespace eosio {
-   namespace chain {
-      // Add this in symbol.hpp (line 172)
-      inline bool operator== (const extended_symbol& lhs, const extended_symbol& rhs)
-      {
-         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) == ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
       }
-      inline bool operator!= (const extended_symbol& lhs, const extended_symbol& rhs)
-      {
-         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) != ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
+
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "token whitelist") try {
+
+   GIVEN("alice has 5 EOS") {
+
+      create_account_with_resources(name("alice"), config::system_account_name, 1000000);
+      transfer(name("eosio.token"), name("alice"), asset(50000, symbol(4,"EOS")), "memo");
+
+      WHEN("alice deposits without naming the token contract") {
+
+         CHECK(success() == transfer(name("alice"), exchange_account, asset(20000, symbol(4,"EOS")), ""));
+
+         THEN("the deposit is credited to the notifying contract's token") {
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{symbol(4,"EOS"), name("eosio.token")}) == 20000);
+         }
       }
-      inline bool operator< (const extended_symbol& lhs, const extended_symbol& rhs)
-      {
-         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) < ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
+
+      WHEN("alice deposits with a free-text memo") {
+
+         CHECK(success() == transfer(name("alice"), exchange_account, asset(20000, symbol(4,"EOS")), "Hello, exchange! #42"));
+
+         THEN("the memo is ignored and the deposit credited") {
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{symbol(4,"EOS"), name("eosio.token")}) == 20000);
+         }
       }
-      inline bool operator> (const extended_symbol& lhs, const extended_symbol& rhs)
-      {
-         return ( lhs.sym.value() | (uint128_t(lhs.contract.value) << 64) ) > ( rhs.sym.value() | (uint128_t(rhs.contract.value) << 64) );
+
+      WHEN("alice deposits naming another token contract") {
+
+         THEN("the deposit is rejected") {
+            CHECK(wasm_assert_msg("memo names a different token contract")
+                  == transfer(name("alice"), exchange_account, asset(20000, symbol(4,"EOS")), "d:other.token"));
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{symbol(4,"EOS"), name("eosio.token")}) == 0);
+         }
       }
-   }
-}
 
-namespace eosio_system {
+      WHEN("eosio.token is removed from the whitelist") {
 
-   class exchange_tester : public eosio_system_tester {
-   public:
-      friend inline bool operator< (const extended_symbol& lhs, const extended_symbol& rhs);
+         REQUIRE(success() == removetoken(name("eosio.token")));
 
-      static name exchange_account;
-      exchange_tester() {
-         deploy_contract();
+         THEN("its transfers are rejected") {
+            CHECK(wasm_assert_msg("token contract is not approved")
+                  == transfer(name("alice"), exchange_account, asset(20000, symbol(4,"EOS")), ""));
+         }
       }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "withdraw") try {
+
+   GIVEN("alice has 5 EOS and 2 BTC on the exchange") {
 
-      abi_serializer deploy_code(name account, const std::vector<uint8_t>& wasm, const std::vector<char>& abiname) {
-         set_code(account, wasm);
-         set_abi(account, abiname.data());
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      token btc_token(this, name("eosio.token"), asset(2100000000000000, btc_sym));
+      btc_token.issue(name("eosio.token"), asset(2100000000000000, btc_sym));
 
-         produce_blocks();
-         const auto& accnt = control->db().get<account_object, by_name>(account);
+      create_account_with_resources(name("alice"), config::system_account_name, 1000000);
+      transfer(name("eosio.token"), name("alice"), asset(50000, eos_sym), "memo");
+      transfer(name("eosio.token"), name("alice"), asset(200000000, btc_sym), "memo");
+      REQUIRE(success() == transfer(name("alice"), exchange_account, asset(50000, eos_sym), ""));
+      REQUIRE(success() == transfer(name("alice"), exchange_account, asset(200000000, btc_sym), ""));
+
+      WHEN("alice withdraws 2 EOS") {
 
-         abi_serializer abi_ser;
-         abi_def        abi;
-         REQUIRE(abi_serializer::to_abi(accnt.abi, abi));
-         abi_ser.set_abi(abi, abi_serializer_max_time);
-         return abi_ser;
+         REQUIRE(success() == withdraw(name("alice"), extended_asset{asset(20000, eos_sym), name("eosio.token")}));
+
+         THEN("her exchange balance is debited and the tokens are paid out") {
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 30000);
+            CHECK(get_balance(name("alice"), eos_sym) == asset(20000, eos_sym));
+            CHECK(wasm_assert_msg("overdrawn balance")
+                  == withdraw(name("alice"), extended_asset{asset(30001, eos_sym), name("eosio.token")}));
+         }
       }
 
-      void deploy_contract() {
-         // create_account(exchange_account);
-         create_account_with_resources(exchange_account, config::system_account_name, 1000000);
-         produce_blocks(2);
-         deploy_code(exchange_account, contracts::exchange_wasm(), contracts::exchange_abi());
+      WHEN("alice withdraws only her BTC") {
 
-         eos_token = token(this, name("eosio.token"), asset(10000000000000, symbol(4,"EOS")));
-         eos_token.issue(name("eosio.token"), asset(10000000000000, symbol(4,"EOS")));
+         std::vector<extended_symbol> tokens{ extended_symbol{btc_sym, name("eosio.token")} };
+         REQUIRE(success() == withdrawall(name("alice"), fc::variant(tokens)));
 
-         add_code_permission(exchange_account);
+         THEN("the BTC is paid out and the EOS stays") {
+            CHECK(get_balance(name("alice"), btc_sym) == asset(200000000, btc_sym));
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 50000);
+            CHECK(wasm_assert_msg("no balance to withdraw") == withdrawall(name("alice"), fc::variant(tokens)));
+         }
       }
 
-      action_result push_action_ex(account_name actor, const name& code, const action_name& acttype, const variant_object& data) {
-         return base_tester::push_action(get_action(code, acttype, {permission_level{actor, config::active_name}}, data), uint64_t(actor));
+      WHEN("alice withdraws everything") {
+
+         REQUIRE(success() == withdrawall(name("alice"), fc::variant()));
+
+         THEN("every balance is paid out") {
+            CHECK(get_balance(name("alice"), eos_sym) == asset(50000, eos_sym));
+            CHECK(get_balance(name("alice"), btc_sym) == asset(200000000, btc_sym));
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 0);
+            CHECK(wasm_assert_msg("nothing to withdraw") == withdrawall(name("alice"), fc::variant()));
+         }
       }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "migrate") try {
+
+   GIVEN("alice has 2 EOS and 1 BTC in a legacy exchange account") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      token btc_token(this, name("eosio.token"), asset(2100000000000000, btc_sym));
+      btc_token.issue(name("eosio.token"), asset(2100000000000000, btc_sym));
 
-      action_result push_action_ex(const std::vector<permission_level>& perms,
-                                   const name&                          code,
-                                   const action_name&                   acttype,
-                                   const variant_object&                data,
-                                   const std::vector<permission_level>& signers) {
-         signed_transaction trx;
-         trx.actions.emplace_back(get_action(code, acttype, perms, data));
-         set_transaction_headers(trx);
-         for (const auto& auth : signers) {
-            trx.sign(get_private_key(auth.actor, auth.permission.to_string()), control->get_chain_id());
+      create_account_with_resources(name("alice"), config::system_account_name, 1000000);
+      transfer(name("eosio.token"), name("alice"), asset(50000, eos_sym), "memo");
+      transfer(name("eosio.token"), name("alice"), asset(100000000, btc_sym), "memo");
+      legacy_deposit(name("alice"), asset(20000, eos_sym));
+      legacy_deposit(name("alice"), asset(100000000, btc_sym));
+
+      REQUIRE(has_legacy_account(name("alice")));
+      REQUIRE(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 0);
+
+      WHEN("the account is migrated") {
+
+         REQUIRE(success() == migrate(name("alice")));
+
+         THEN("every legacy balance moves to exbalances and the legacy row is removed") {
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 20000);
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{btc_sym, name("eosio.token")}) == 100000000);
+            CHECK(!has_legacy_account(name("alice")));
          }
-         try {
-            // print_action_console(push_transaction(trx));
-            push_transaction(trx);
-         } catch (const fc::exception& ex) {
-            edump((ex.to_detail_string()));
-            return error(ex.top_message()); // top_message() is assumed by many tests; otherwise they fail
-            // return error(ex.to_detail_string());
+
+         AND_WHEN("it is migrated again") {
+            THEN("there is nothing left to migrate and the balances are unchanged") {
+               CHECK(wasm_assert_msg("no legacy exchange account") == migrate(name("alice")));
+               CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 20000);
+            }
          }
-         produce_block();
-         BOOST_REQUIRE_EQUAL(true, chain_has_transaction(trx.id()));
-         return success();
       }
 
-      /*
-      *  Helper Functions
-      */
+      WHEN("alice deposits EOS to the current exchange before migrating") {
+
+         REQUIRE(success() == transfer(name("alice"), exchange_account, asset(10000, eos_sym), ""));
+         REQUIRE(success() == migrate(name("alice")));
+
+         THEN("the legacy EOS is merged into her existing balance") {
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 30000);
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{btc_sym, name("eosio.token")}) == 100000000);
+            CHECK(!has_legacy_account(name("alice")));
+         }
+      }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "trade") try {
 
-      void add_code_permission(name account) {
-         const auto priv_key = this->get_private_key(account.to_string(), "active");
-         const auto pub_key  = priv_key.get_public_key();
+   GIVEN("an EOS/BTC market with two asks on the book") {
 
-         this->set_authority(account, name("active"), authority(1, {key_weight{pub_key, 1}}, {{permission_level{account, name("eosio.code")}, 1}}),
-                             "owner");
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
+
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(500000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8320000, eos_sym), asset(500000000, btc_sym), 10));
+
+      WHEN("alice bids through both asks with a budget of one fill") {
+
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8320000, eos_sym), asset(700000000, btc_sym), 1));
+
+         THEN("the remainder waits in a cursor until match resumes it") {
+            CHECK(get_order(1, name("askorders"), 1).is_null());
+            CHECK(get_cursor(1, 3)["volume"].as<asset>() == asset(200000000, btc_sym));
+
+            CHECK(success() == match(name("bob"), 1, 10));
+            CHECK(get_cursor(1, 3).is_null());
+            CHECK(get_order(1, name("askorders"), 2)["volume"].as<asset>() == asset(300000000, btc_sym));
+            CHECK(get_order(1, name("bidorders"), 3).is_null());
+         }
       }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "fill rounding") try {
+
+   GIVEN("an EOS/BTC market at a price that does not divide the ask volumes") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
+
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(50000001, btc_sym), 10));
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(50000001, btc_sym), 10));
+
+      WHEN("alice bids for both asks at once") {
 
-      transaction make_transaction(const fc::variants& actions) {
-         variant pretty_trx = fc::mutable_variant_object()("expiration", "2020-01-01T00:30")("ref_block_num", 2)("ref_block_prefix", 3)(
-             "max_net_usage_words", 0)("max_cpu_usage_ms", 0)("delay_sec", 0)("actions", actions);
-         transaction trx;
-         abi_serializer::from_variant(pretty_trx, trx, get_resolver(), abi_serializer_max_time);
-         return trx;
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8310000, eos_sym), asset(100000002, btc_sym), 10));
+
+         THEN("she pays exactly the rounded up value she locked") {
+            CHECK(get_order(1, name("askorders"), 2).is_null());
+            CHECK(get_order(1, name("bidorders"), 3).is_null());
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 100000000 - 8310001);
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{btc_sym, name("eosio.token")}) == 100000002);
+            CHECK(get_exchange_balance(name("bob"), extended_symbol{eos_sym, name("eosio.token")}) == 8310001);
+         }
       }
 
-      transaction make_transaction(vector<action>&& actions) {
-         transaction trx;
-         trx.actions = std::move(actions);
-         set_transaction_headers(trx);
-         return trx;
+      WHEN("alice bids for one ask and one unit of the next") {
+
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8310000, eos_sym), asset(50000002, btc_sym), 10));
+
+         THEN("the fills add up to her lock and nothing is taken from her free balance") {
+            CHECK(get_order(1, name("askorders"), 2)["volume"].as<asset>() == asset(50000000, btc_sym));
+            CHECK(get_order(1, name("bidorders"), 3).is_null());
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 100000000 - 4155001);
+            CHECK(get_exchange_balance(name("bob"), extended_symbol{eos_sym, name("eosio.token")}) == 4155001);
+         }
       }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "fill reporting") try {
+
+   GIVEN("an EOS/BTC market with two asks on the book") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
+
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8320000, eos_sym), asset(100000000, btc_sym), 10));
+
+      WHEN("alice bids through both asks") {
+
+         auto fills = get_trade_fills(name("alice"), 1, name("bid"), asset(8320000, eos_sym), asset(150000000, btc_sym), 10);
 
-      transaction
-      make_transaction_with_data(account_name code, name action, const vector<permission_level>& perms, const fc::variant& data) {
-         return make_transaction({fc::mutable_variant_object()("account", code)("name", action)("authorization", perms)("data", data)});
+         THEN("each fill is reported to exchange.results at the maker's price") {
+            REQUIRE(fills.size() == 2);
+            CHECK(fills[0]["market"].as<uint64_t>() == 1);
+            CHECK(fills[0]["maker"].as<name>() == name("bob"));
+            CHECK(fills[0]["taker"].as<name>() == name("alice"));
+            CHECK(fills[0]["price"].as<asset>() == asset(8310000, eos_sym));
+            CHECK(fills[0]["volume"].as<asset>() == asset(100000000, btc_sym));
+            CHECK(fills[1]["maker_order_id"].as<uint64_t>() == 2);
+            CHECK(fills[1]["taker_order_id"].as<uint64_t>() == 3);
+            CHECK(fills[1]["volume"].as<asset>() == asset(50000000, btc_sym));
+         }
       }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "time in force") try {
+
+   GIVEN("an EOS/BTC market with one ask of 1 BTC") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
 
-      /*
-      *  Contract Actions
-      */
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10));
 
-      action_result transfer(name from, name to, const asset& amount, std::string memo) {
-         return push_action_ex(from, name("eosio.token"), name("transfer"),
-                               mutable_variant_object()("from", from)("to", to)("quantity", amount)("memo", memo));
+      WHEN("alice sends orders that cannot complete as asked") {
+
+         THEN("fill-or-kill and post-only orders are rejected") {
+            CHECK(wasm_assert_msg("fill-or-kill order cannot be filled in full")
+                  == trade(name("alice"), 1, name("bid"), asset(8310000, eos_sym), asset(200000000, btc_sym), 10, time_point_sec(), name("fok")));
+            CHECK(wasm_assert_msg("post-only order would cross the book")
+                  == trade(name("alice"), 1, name("bid"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10, time_point_sec(), name("post")));
+         }
       }
 
-      /*
-      *  TABLES
-      */
+      WHEN("alice bids 2 BTC immediate-or-cancel") {
 
-      abi_serializer get_serializer() {
-         const auto& acnt = control->get_account(CONTRACT_ACCOUNT);
-         auto        abi  = acnt.get_abi();
-         return abi_serializer(abi, abi_serializer_max_time);
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8310000, eos_sym), asset(200000000, btc_sym), 10, time_point_sec(), name("ioc")));
+
+         THEN("1 BTC fills and the rest is refunded instead of resting") {
+            CHECK(get_order(1, name("bidorders"), 2).is_null());
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{btc_sym, name("eosio.token")}) == 100000000);
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{eos_sym, name("eosio.token")}) == 100000000 - 8310000);
+         }
       }
+   }
+
+} FC_LOG_AND_RETHROW()
 
-      std::map<extended_symbol, int64_t> get_exchange_account_balance(account_name acc) {
-         std::map<extended_symbol, int64_t> balances;
-         
-         vector<char> data        = get_row_by_account(CONTRACT_ACCOUNT, acc, name("exaccounts"), acc);
 
-         if ( data.empty() ) {
-            CHECK( 1 == 1);
-            return balances;
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "placeorders") try {
+
+   GIVEN("bob has BTC on the exchange and an EOS/BTC market exists") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      token btc_token(this, name("eosio.token"), asset(2100000000000000, btc_sym));
+      btc_token.issue(name("eosio.token"), asset(2100000000000000, btc_sym));
+
+      create_account_with_resources(name("bob"), config::system_account_name, 1000000);
+      transfer(name("eosio.token"), name("bob"), asset(1000000000, btc_sym), "memo");
+      REQUIRE(success() == transfer(name("bob"), exchange_account, asset(1000000000, btc_sym), "eosio.token"));
+      REQUIRE(success() == createmarket(extended_symbol{eos_sym, name("eosio.token")}, extended_symbol{btc_sym, name("eosio.token")}));
+
+      auto ask = [&](int64_t price, int64_t volume, uint64_t replace_id) {
+         return fc::variant(mvo()("market_id", 1)("side", "ask")("price", asset(price, eos_sym))
+                                 ("volume", asset(volume, btc_sym))("replace_id", replace_id)("max_fills", 0)
+                                 ("expiration", time_point_sec())("time_in_force", name()));
+      };
+
+      WHEN("bob quotes two levels and then replaces the first one") {
+
+         REQUIRE(success() == placeorders(name("bob"), { ask(8310000, 300000000, 0), ask(8320000, 300000000, 0) }));
+         REQUIRE(success() == placeorders(name("bob"), { ask(8330000, 100000000, 1) }));
+
+         THEN("only the replacement and the untouched level rest on the book") {
+            CHECK(get_order(1, name("askorders"), 1).is_null());
+            CHECK(get_order(1, name("askorders"), 2)["volume"].as<asset>() == asset(300000000, btc_sym));
+            CHECK(get_order(1, name("askorders"), 3)["volume"].as<asset>() == asset(100000000, btc_sym));
+            CHECK(get_exchange_balance(name("bob"), extended_symbol{btc_sym, name("eosio.token")}) == 600000000);
          }
-         else {
-            auto var = get_serializer().binary_to_variant("exaccount", data, abi_serializer_max_time);
-            auto owner = var["owner"].as<name>();
-            CHECK( owner == name("alice"));
+      }
+   }
+
+} FC_LOG_AND_RETHROW()
 
-            // auto balance2 = var["balances"];
-            // CHECK( balance2 == variant() );
-            // CHECK( balance2 == mvo()("key", "eosio.token")("value", "2000") );
 
-            auto balance = var["balances"].as<vector<fc::variant>>();
-            CHECK( balance.size() == 1);
-            
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "cancel orders") try {
 
-            struct tmp_struct{
-               extended_symbol key;
-               int64 value;
-            };
-            std::vector<variant> p2;
-            auto x = balance[0].as<tmp_struct>();
+   GIVEN("alice has three bids on EOS/BTC and an ask on BTC/EOS") {
 
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
 
-            // std::vector<pair<extended_symbol, int64_t>> my_vector{balance.size()};
-            // std::transform(balance.begin(), balance.end(), my_vector.begin(), [](auto &v) { return v.template as<pair<extended_symbol, int64_t>>();});
+      REQUIRE(success() == createmarket(extended_symbol{btc_sym, name("eosio.token")}, extended_symbol{eos_sym, name("eosio.token")}));
+      REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8000000, eos_sym), asset(100000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8100000, eos_sym), asset(100000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8200000, eos_sym), asset(100000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("alice"), 2, name("ask"), asset(12000, btc_sym), asset(10000, eos_sym), 10));
 
-            // CHECK( my_vector.begin()->second == 20000);
-            // CHECK(balance.begin()->second == 20000);
+      const extended_symbol eos{eos_sym, name("eosio.token")};
+      REQUIRE(get_exchange_balance(name("alice"), eos) == 100000000 - 24300000 - 10000);
+      REQUIRE(get_open_orders(name("alice"), 1) == 3);
+      REQUIRE(get_open_orders(name("alice"), 2) == 1);
 
-            // balances.insert(balance_vector.begin(), balance_vector.end());
-            return balances;
+      WHEN("alice cancels her second bid") {
+
+         REQUIRE(success() == cancelorder(name("alice"), 1, name("bid"), 2));
+
+         THEN("it leaves the book and its funds are released") {
+            CHECK(get_order(1, name("bidorders"), 2).is_null());
+            CHECK(get_exchange_balance(name("alice"), eos) == 100000000 - 16200000 - 10000);
+            CHECK(get_open_orders(name("alice"), 1) == 2);
+            CHECK(wasm_assert_msg("order does not exist") == cancelorder(name("alice"), 1, name("bid"), 2));
+            CHECK(wasm_assert_msg("order does not exist") == cancelorder(name("alice"), 1, name("ask"), 1));
          }
       }
 
-      /*
-      *  eosio.token Contract Interface
-      */
+      WHEN("bob tries to cancel alice's bid") {
 
-      struct token {
-         exchange_tester* tester_;
-         name           issuer_;
-         symbol         sym_;
+         THEN("the order is not his") {
+            CHECK(wasm_assert_msg("order belongs to another trader") == cancelorder(name("bob"), 1, name("bid"), 1));
+            CHECK(!get_order(1, name("bidorders"), 1).is_null());
+         }
+      }
 
-         token() {}
+      WHEN("alice cancels two orders on every market") {
 
-         token(exchange_tester* tester, name issuer, asset max_supply)
-            : tester_(tester)
-            , issuer_(issuer)
-            , sym_(max_supply.get_symbol()) {
-            create_currency(name("eosio.token"), issuer_, max_supply);
+         REQUIRE(success() == cancelall(name("alice"), fc::variant(), 2));
+
+         THEN("only her first two bids are cancelled") {
+            CHECK(get_order(1, name("bidorders"), 1).is_null());
+            CHECK(get_order(1, name("bidorders"), 2).is_null());
+            CHECK(!get_order(1, name("bidorders"), 3).is_null());
+            CHECK(!get_order(2, name("askorders"), 4).is_null());
+            CHECK(get_open_orders(name("alice"), 1) == 1);
+            CHECK(get_exchange_balance(name("alice"), eos) == 100000000 - 8200000 - 10000);
          }
-         
-         void create_currency( name contract, name issuer, asset maxsupply ) {
-            tester_->push_action_ex(issuer, name("eosio.token"), name("create"),
-                                    mutable_variant_object()("issuer", issuer)("maximum_supply", maxsupply));
+
+         AND_WHEN("she cancels the rest") {
+
+            REQUIRE(success() == cancelall(name("alice"), fc::variant(), 10));
+
+            THEN("both markets are empty and all her funds are free") {
+               CHECK(get_order(1, name("bidorders"), 3).is_null());
+               CHECK(get_order(2, name("askorders"), 4).is_null());
+               CHECK(get_open_orders(name("alice"), 1) == 0);
+               CHECK(get_open_orders(name("alice"), 2) == 0);
+               CHECK(get_exchange_balance(name("alice"), eos) == 100000000);
+            }
          }
-         void issue(name to, asset quantity, std::string memo = "") {
-            tester_->push_action_ex(issuer_, name("eosio.token"), name("issue"),
-                                    mutable_variant_object()("to", to)("quantity", quantity)("memo", memo));
+      }
+
+      WHEN("alice cancels everything on the second market") {
+
+         REQUIRE(success() == cancelall(name("alice"), fc::variant(uint64_t(2)), 10));
+
+         THEN("her bids on the first market stay") {
+            CHECK(get_order(2, name("askorders"), 4).is_null());
+            CHECK(get_open_orders(name("alice"), 1) == 3);
+            CHECK(get_open_orders(name("alice"), 2) == 0);
          }
-         void open(name owner, name ram_payer) {
-            REQUIRE(tester_->push_action_ex(ram_payer, name("eosio.token"), name("open"),
-                                            mutable_variant_object()("owner", owner)("symbol", sym_)("ram_payer", ram_payer)) ==
-                    tester_->success());
+      }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "deposit and trade") try {
+
+   GIVEN("an EOS/BTC market and bob holding BTC") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      token btc_token(this, name("eosio.token"), asset(2100000000000000, btc_sym));
+      btc_token.issue(name("eosio.token"), asset(2100000000000000, btc_sym));
+
+      create_account_with_resources(name("bob"), config::system_account_name, 1000000);
+      transfer(name("eosio.token"), name("bob"), asset(1000000000, btc_sym), "memo");
+      REQUIRE(success() == createmarket(extended_symbol{eos_sym, name("eosio.token")}, extended_symbol{btc_sym, name("eosio.token")}));
+
+      WHEN("bob sends BTC with an ask memo") {
+
+         REQUIRE(success() == transfer(name("bob"), exchange_account, asset(300000000, btc_sym), "t:1:ask:832.0000"));
+
+         THEN("the deposit is locked in a resting ask") {
+            CHECK(get_order(1, name("askorders"), 1)["volume"].as<asset>() == asset(300000000, btc_sym));
+            CHECK(get_exchange_balance(name("bob"), extended_symbol{btc_sym, name("eosio.token")}) == 0);
          }
-         abi_serializer get_serializer() {
-            const auto& acnt = tester_->control->get_account(name("eosio.token"));
-            auto        abi  = acnt.get_abi();
-            return abi_serializer(abi, abi_serializer_max_time);
+      }
+
+      WHEN("the memo names an unknown market") {
+
+         THEN("the transfer is rejected") {
+            CHECK(wasm_assert_msg("market does not exist")
+                  == transfer(name("bob"), exchange_account, asset(300000000, btc_sym), "t:2:ask:832.0000"));
          }
+      }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "expire") try {
+
+   GIVEN("bob has an ask that expires in 10 seconds") {
 
-         asset get_account_balance(account_name acc) {
-            auto         symbol_code = sym_.to_symbol_code().value;
-            vector<char> data        = tester_->get_row_by_account(name("eosio.token"), acc, name("accounts"), symbol_code);
-            return data.empty() ? asset(0, sym_)
-                                : get_serializer().binary_to_variant("account", data, abi_serializer_max_time)["balance"].as<asset>();
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      token btc_token(this, name("eosio.token"), asset(2100000000000000, btc_sym));
+      btc_token.issue(name("eosio.token"), asset(2100000000000000, btc_sym));
+
+      create_account_with_resources(name("bob"), config::system_account_name, 1000000);
+      transfer(name("eosio.token"), name("bob"), asset(1000000000, btc_sym), "memo");
+      REQUIRE(success() == transfer(name("bob"), exchange_account, asset(1000000000, btc_sym), "eosio.token"));
+      REQUIRE(success() == createmarket(extended_symbol{eos_sym, name("eosio.token")}, extended_symbol{btc_sym, name("eosio.token")}));
+
+      const time_point_sec expiration = time_point_sec(control->head_block_time()) + 10;
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(500000000, btc_sym), 10, expiration));
+      REQUIRE(get_exchange_balance(name("bob"), extended_symbol{btc_sym, name("eosio.token")}) == 500000000);
+
+      WHEN("the expiration passes and anybody cranks expire") {
+
+         produce_block(fc::seconds(11));
+         REQUIRE(success() == expire(name("bob"), 10));
+
+         THEN("the ask is removed and its volume released") {
+            CHECK(get_order(1, name("askorders"), 1).is_null());
+            CHECK(get_exchange_balance(name("bob"), extended_symbol{btc_sym, name("eosio.token")}) == 1000000000);
          }
+      }
+   }
 
-         asset get_supply() {
-            auto         symbol_code = sym_.to_symbol_code().value;
-            vector<char> data        = tester_->get_row_by_account(name("eosio.token"), symbol_code, name("stat"), symbol_code);
-            return data.empty() ? asset(0, sym_)
-                                : get_serializer().binary_to_variant("currency_stats", data, abi_serializer_max_time)["supply"].as<asset>();
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "depth") try {
+
+   GIVEN("two asks at one price, an expiring ask above them and a bid below") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
+
+      const time_point_sec expiration = time_point_sec(control->head_block_time()) + 10;
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8320000, eos_sym), asset(100000000, btc_sym), 10, expiration));
+      REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8000000, eos_sym), asset(100000000, btc_sym), 10));
+
+      THEN("each price has one level with its total volume and order count") {
+         CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym))["volume"].as<asset>() == asset(200000000, btc_sym));
+         CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym))["orders"].as<uint32_t>() == 2);
+         CHECK(get_level(1, name("askdepth"), asset(8320000, eos_sym))["orders"].as<uint32_t>() == 1);
+         CHECK(get_level(1, name("biddepth"), asset(8000000, eos_sym))["volume"].as<asset>() == asset(100000000, btc_sym));
+         CHECK(get_level(1, name("biddepth"), asset(8000000, eos_sym))["orders"].as<uint32_t>() == 1);
+      }
+
+      WHEN("alice takes half of the first ask") {
+
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8310000, eos_sym), asset(50000000, btc_sym), 10));
+
+         THEN("the level loses the volume but keeps both orders") {
+            CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym))["volume"].as<asset>() == asset(150000000, btc_sym));
+            CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym))["orders"].as<uint32_t>() == 2);
+            CHECK(get_level(1, name("biddepth"), asset(8310000, eos_sym)).is_null());
          }
-      };
 
-      token eos_token;
-   };
+         AND_WHEN("bob cancels both asks at that price") {
 
-   name exchange_tester::exchange_account = CONTRACT_ACCOUNT;
+            REQUIRE(success() == cancelorder(name("bob"), 1, name("ask"), 2));
+            CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym))["volume"].as<asset>() == asset(50000000, btc_sym));
+            CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym))["orders"].as<uint32_t>() == 1);
+            REQUIRE(success() == cancelorder(name("bob"), 1, name("ask"), 1));
 
-} // namespace eosio_system
+            THEN("the emptied level is erased") {
+               CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym)).is_null());
+               CHECK(!get_level(1, name("askdepth"), asset(8320000, eos_sym)).is_null());
+            }
+         }
+      }
 
+      WHEN("the ask above expires") {
 
-TEST_CASE_FIXTURE(eosio_system::exchange_tester, "deposit") try {
+         produce_block(fc::seconds(11));
+         REQUIRE(success() == expire(name("bob"), 10));
 
-   GIVEN("alice has 5 EOS") {
+         THEN("its level is erased and the others stay") {
+            CHECK(get_level(1, name("askdepth"), asset(8320000, eos_sym)).is_null());
+            CHECK(get_level(1, name("askdepth"), asset(8310000, eos_sym))["orders"].as<uint32_t>() == 2);
+            CHECK(get_level(1, name("biddepth"), asset(8000000, eos_sym))["orders"].as<uint32_t>() == 1);
+         }
+      }
+   }
 
-      create_account_with_resources(name("alice"), config::system_account_name, 1000000);
-      transfer(name("eosio.token"), name("alice"), asset(50000, symbol(4,"EOS")), "memo");
+} FC_LOG_AND_RETHROW()
 
-      REQUIRE(eos_token.get_account_balance(name("alice")) == asset(50000, symbol(4,"EOS")));
 
-      WHEN("alice deposits 2 EOS into the exchange") {
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "recent trades") try {
 
-         CHECK(success() == transfer(name("alice"), exchange_account, asset(20000, symbol(4,"EOS")), "eosio.token"));
+   GIVEN("a market keeping its last two trades and three asks on the book") {
 
-         THEN("alice would have 2 EOS in her exchange account") {
-            CHECK(eos_token.get_account_balance(name("alice")) == asset(30000, symbol(4,"EOS")));
-            CHECK(eos_token.get_account_balance(exchange_account) == asset(20000, symbol(4,"EOS")));
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
 
-            extended_symbol return_sym;
-            return_sym.sym = symbol(4, "EOS");
-            return_sym.contract = name("eosio.token");
+      REQUIRE(success() == settradecap(1, 2));
+      for (int64_t price : {8310000, 8320000, 8330000}) {
+         REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(price, eos_sym), asset(10000000, btc_sym), 10));
+      }
 
-            std::map<extended_symbol, int64_t> return_balance;
-            return_balance.emplace(return_sym, 20000);
+      WHEN("alice takes all three asks") {
 
-            std::map<extended_symbol, int64_t> alice_ex_balance = get_exchange_account_balance(name("alice"));
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8330000, eos_sym), asset(30000000, btc_sym), 10));
 
+         THEN("the third trade overwrote the first slot") {
+            CHECK(get_recent_trade(1, 0)["seq"].as<uint64_t>() == 2);
+            CHECK(get_recent_trade(1, 0)["maker_order_id"].as<uint64_t>() == 3);
+            CHECK(get_recent_trade(1, 1)["seq"].as<uint64_t>() == 1);
+            CHECK(get_recent_trade(1, 2).is_null());
          }
+      }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "candles") try {
+
+   GIVEN("an EOS/BTC market with two asks on the book") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
+
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8320000, eos_sym), asset(100000000, btc_sym), 10));
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10));
 
+      WHEN("alice takes both asks in one trade") {
+
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8320000, eos_sym), asset(200000000, btc_sym), 10));
+         const uint32_t now = time_point_sec(control->pending_block_time()).sec_since_epoch();
+
+         THEN("the day candle holds both fills") {
+            auto day = get_candle(1, 86400, now - now % 86400);
+            REQUIRE(!day.is_null());
+            CHECK(day["trades"].as<uint32_t>() == 2);
+            CHECK(day["open"]["base"].as<uint64_t>() == 8310000);
+            CHECK(day["close"]["base"].as<uint64_t>() == 8320000);
+            CHECK(day["quote_volume"].as<asset>() == asset(200000000, btc_sym));
+            CHECK(day["base_volume"].as<asset>() == asset(16630000, eos_sym));
+         }
       }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "fees") try {
 
+   GIVEN("a market charging 0.1% to makers and 0.2% to takers") {
+
+      const symbol eos_sym(4, "EOS");
+      const symbol btc_sym(8, "BTC");
+      setup_btc_eos_market();
+
+      create_account_with_resources(name("feesink"), config::system_account_name, 1000000);
+      REQUIRE(success() == setfees(1, 10, 20));
+      REQUIRE(success() == trade(name("bob"), 1, name("ask"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10));
+
+      WHEN("alice takes the ask and the fees are claimed") {
+
+         REQUIRE(success() == trade(name("alice"), 1, name("bid"), asset(8310000, eos_sym), asset(100000000, btc_sym), 10));
+
+         THEN("both sides pay their fee and the fee pools are paid out") {
+            CHECK(get_exchange_balance(name("alice"), extended_symbol{btc_sym, name("eosio.token")}) == 100000000 - 200000);
+            CHECK(get_exchange_balance(name("bob"), extended_symbol{eos_sym, name("eosio.token")}) == 8310000 - 8310);
+
+            REQUIRE(success() == claimfees(name("feesink"), {1}));
+            CHECK(get_balance(name("feesink"), eos_sym) == asset(8310, eos_sym));
+            CHECK(get_balance(name("feesink"), btc_sym) == asset(200000, btc_sym));
+         }
+      }
    }
 
 } FC_LOG_AND_RETHROW()
 
 
-TEST_CASE_FIXTURE(eosio_system::exchange_tester, "withdraw") try {
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "billed cpu") try {
+
+   GIVEN("the billed CPU of the exchange's transactions, as the action profiler sees them") {
+
+      std::vector<uint32_t> billed;
+      boost::signals2::scoped_connection recording = control->applied_transaction.connect(
+         [&](std::tuple<const transaction_trace_ptr&, const signed_transaction&> t) {
+            const auto& trace = std::get<0>(t);
+            if (trace->receipt && !trace->action_traces.empty() && trace->action_traces.front().act.account == exchange_account)
+               billed.push_back(trace->receipt->cpu_usage_us);
+         });
 
+      WHEN("an action is pushed through push_action_ex while CPU is billed objectively") {
+
+         objective_billing = true;
+         REQUIRE(success() == removetoken(name("eosio.token")));
+
+         THEN("its transaction is billed the CPU it used, not the tester's default") {
+            REQUIRE(billed.size() == 1);
+            CHECK(billed[0] > 0);
+            CHECK(billed[0] != DEFAULT_BILLED_CPU_TIME_US);
+         }
+      }
 
-} FC_LOG_AND_RETHROW()
\ No newline at end of file
+      WHEN("an action is pushed through push_action_ex with the default billing") {
+
+         objective_billing = false;
+         REQUIRE(success() == removetoken(name("eosio.token")));
+
+         THEN("its transaction is billed the tester's default") {
+            REQUIRE(billed.size() == 1);
+            CHECK(billed[0] == DEFAULT_BILLED_CPU_TIME_US);
+         }
+      }
+   }
+
+} FC_LOG_AND_RETHROW()
@@ -0,0 +1,404 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+#include "exchange_tester.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <tuple>
+
+namespace eosio_system {
+
+   /**
+    *  Leading fields of the exchange rows read by the conservation check, unpacked
+    *  straight from the table bytes. The fields after them are never read.
+    */
+   struct replay_balance {
+      uint64_t         id;
+      extended_asset   balance;
+   };
+
+   struct replay_order {
+      uint64_t   id;
+      name       trader;
+      uint64_t   price_base;
+      uint64_t   price_quote;
+      asset      volume;
+   };
+
+   struct replay_cursor {
+      uint64_t   id;
+      name       trader;
+      name       side;
+      uint64_t   price_base;
+      uint64_t   price_quote;
+      asset      volume;
+      asset      locked;
+   };
+
+} // namespace eosio_system
+
+FC_REFLECT(eosio_system::replay_balance, (id)(balance))
+FC_REFLECT(eosio_system::replay_order, (id)(trader)(price_base)(price_quote)(volume))
+FC_REFLECT(eosio_system::replay_cursor, (id)(trader)(side)(price_base)(price_quote)(volume)(locked))
+
+namespace eosio_system {
+
+   /**
+    *  Replays a seeded random stream of deposits, orders, cancels and withdrawals of
+    *  many traders on several markets, `block_actions` transactions per block, and
+    *  checks after every block that the exchange's eosio.token balance of each token
+    *  equals what it owes: balances on deposit, funds locked by resting and parked
+    *  orders, and unclaimed fees.
+    *
+    *  REPLAY_ACTIONS (default 10000) and REPLAY_SEED (default 1) set the length and
+    *  the seed of the stream. Only the rejections in `expected_rejections` are part of
+    *  the stream; any other failed transaction fails the replay.
+    */
+   class exchange_replay_tester : public exchange_tester {
+   public:
+      static constexpr uint32_t block_actions = 50;
+      static constexpr uint32_t trader_count  = 64;
+
+      struct replay_market {
+         uint64_t   id;
+         symbol     base;
+         symbol     quote;
+         int64_t    mid;     // base units per whole quote unit
+         int64_t    tick;
+      };
+
+      enum class kind { deposit, deposit_trade, trade, cancel, cancel_all, withdraw, withdraw_all, match, expire, count };
+
+      /**
+       *  What the exchange owes per token symbol after a block, and the orders and
+       *  balances the next block's actions pick from.
+       */
+      struct replay_state {
+         std::map<uint64_t, int64_t>                                owed;
+         std::vector<std::tuple<name, uint64_t, bool, uint64_t>>   orders;     // trader, market, bids, id
+         std::vector<std::pair<name, asset>>                        balances;
+      };
+
+      exchange_replay_tester()
+         : exchange_ser(control->get_account(exchange_account).get_abi(), abi_serializer_max_time)
+         , token_ser(control->get_account(name("eosio.token")).get_abi(), abi_serializer_max_time) {
+         const symbol eos_sym(4, "EOS");
+         const symbol btc_sym(8, "BTC");
+         const symbol eth_sym(8, "ETH");
+         const symbol usd_sym(4, "USD");
+
+         token btc_token(this, name("eosio.token"), asset(2100000000000000, btc_sym));
+         btc_token.issue(name("eosio.token"), asset(2100000000000000, btc_sym));
+         token eth_token(this, name("eosio.token"), asset(10000000000000000, eth_sym));
+         eth_token.issue(name("eosio.token"), asset(10000000000000000, eth_sym));
+         token usd_token(this, name("eosio.token"), asset(1000000000000000, usd_sym));
+         usd_token.issue(name("eosio.token"), asset(1000000000000000, usd_sym));
+         tokens = { eos_sym, btc_sym, eth_sym, usd_sym };
+
+         markets = {
+            { 1, eos_sym, btc_sym, 8300000, 100 },
+            { 2, eos_sym, eth_sym, 250000, 10 },
+            { 3, eos_sym, usd_sym, 2500, 1 },
+            { 4, btc_sym, eth_sym, 3000000, 1000 },
+         };
+         for (const auto& m : markets) {
+            REQUIRE(success() == createmarket(extended_symbol{m.base, name("eosio.token")}, extended_symbol{m.quote, name("eosio.token")}));
+         }
+         REQUIRE(success() == setfees(1, 10, 20));
+         REQUIRE(success() == setfees(4, 5, 5));
+
+         // the exchange pays the RAM of every row; traders stake enough CPU and NET for the whole stream
+         REQUIRE(success() == buyrambytes(config::system_account_name, exchange_account, 64 * 1024 * 1024));
+
+         const int64_t funding[] = { 10000000000, 100000000000, 1000000000000, 10000000000 };
+         for (uint32_t i = 0; i < trader_count; ++i) {
+            const name trader(std::string("trader") + char('a' + i / 26) + char('a' + i % 26));
+            create_account_with_resources(trader, config::system_account_name, core_sym::from_string("10.0000"), false,
+                                          core_sym::from_string("100000.0000"), core_sym::from_string("100000.0000"));
+            traders.push_back(trader);
+            keys.push_back(get_private_key(trader, "active"));
+
+            for (size_t t = 0; t < tokens.size(); ++t) {
+               transfer(name("eosio.token"), trader, asset(funding[t], tokens[t]), "");
+               REQUIRE(success() == transfer(trader, exchange_account, asset(funding[t] / 2, tokens[t]), ""));
+            }
+         }
+         produce_block();
+      }
+
+      /**
+       *  Amount of base owed for `quote_amount` at the price of `o`, rounded up as the
+       *  contract locks it for a bid.
+       */
+      template<typename Row>
+      static int64_t locked_base(const Row& o, int64_t quote_amount) {
+         return int64_t((uint128_t(o.price_base) * uint128_t(quote_amount) + o.price_quote - 1) / o.price_quote);
+      }
+
+      /**
+       *  Calls `f(scope, row)` for every row of `table` of the exchange, in every scope.
+       */
+      template<typename Row, typename F>
+      void for_each_row(name table, F&& f) {
+         const auto& db     = control->db();
+         const auto& tables = db.get_index<table_id_multi_index, by_code_scope_table>();
+         const auto& rows   = db.get_index<key_value_index, by_scope_primary>();
+         for (auto t = tables.lower_bound(boost::make_tuple(exchange_account)); t != tables.end() && t->code == exchange_account; ++t) {
+            if (t->table != table) {
+               continue;
+            }
+            for (auto r = rows.lower_bound(boost::make_tuple(t->id, 0)); r != rows.end() && r->t_id == t->id; ++r) {
+               Row row;
+               fc::datastream<const char*> ds(r->value.data(), r->value.size());
+               fc::raw::unpack(ds, row);
+               f(t->scope, row);
+            }
+         }
+      }
+
+      replay_state read_state() {
+         replay_state state;
+
+         for_each_row<replay_balance>(name("exbalances"), [&](name owner, const replay_balance& b) {
+            state.owed[b.balance.quantity.get_symbol().value()] += b.balance.quantity.get_amount();
+            state.balances.emplace_back(owner, b.balance.quantity);
+         });
+         for_each_row<replay_balance>(name("fees"), [&](name, const replay_balance& f) {
+            state.owed[f.balance.quantity.get_symbol().value()] += f.balance.quantity.get_amount();
+         });
+         for (bool bids : { true, false }) {
+            for_each_row<replay_order>(name(bids ? "bidorders" : "askorders"), [&](name scope, const replay_order& o) {
+               const auto& m = markets.at(scope.to_uint64_t() - 1);
+               if (bids) {
+                  state.owed[m.base.value()] += locked_base(o, o.volume.get_amount());
+               } else {
+                  state.owed[m.quote.value()] += o.volume.get_amount();
+               }
+               state.orders.emplace_back(o.trader, scope.to_uint64_t(), bids, o.id);
+            });
+         }
+         for_each_row<replay_cursor>(name("cursors"), [&](name, const replay_cursor& c) {
+            state.owed[c.locked.get_symbol().value()] += c.locked.get_amount();
+         });
+         return state;
+      }
+
+      /**
+       *  The exchange's eosio.token balance of `sym`.
+       */
+      int64_t held(const symbol& sym) {
+         vector<char> data = get_row_by_account(name("eosio.token"), exchange_account, name("accounts"), name(sym.to_symbol_code().value));
+         return data.empty() ? 0 : fc::raw::unpack<asset>(data).get_amount();
+      }
+
+      signed_transaction make_trx(uint32_t trader, const abi_serializer& ser, name code, name act, const variant_object& data, uint32_t slot) {
+         action a;
+         a.account       = code;
+         a.name          = act;
+         a.authorization = { permission_level{traders[trader], config::active_name} };
+         a.data          = ser.variant_to_binary(ser.get_action_type(act), data, abi_serializer_max_time);
+
+         signed_transaction trx;
+         trx.actions.push_back(std::move(a));
+         // identical actions in one block would share a transaction id
+         set_transaction_headers(trx, DEFAULT_EXPIRATION_DELTA + slot);
+         trx.sign(keys[trader], control->get_chain_id());
+         return trx;
+      }
+
+      /**
+       *  Next action of the stream, drawn against the state read after the last block.
+       */
+      signed_transaction next_action(std::mt19937_64& rng, const replay_state& state, uint32_t slot, kind& k) {
+         auto pick = [&](uint64_t n) { return std::uniform_int_distribution<uint64_t>(0, n - 1)(rng); };
+
+         const uint32_t trader = pick(traders.size());
+         const auto&    m      = markets[pick(markets.size())];
+         const bool     bids   = pick(2) == 0;
+         const asset    price(m.mid + (int64_t(pick(41)) - 20) * m.tick, m.base);
+         int64_t        whole  = 1;
+         for (uint8_t i = 0; i < m.quote.decimals(); ++i) {
+            whole *= 10;
+         }
+         const asset    volume(int64_t(1 + pick(20)) * whole / 10, m.quote);
+
+         const uint64_t roll = pick(100);
+         k = roll < 10 ? kind::deposit
+           : roll < 15 ? kind::deposit_trade
+           : roll < 65 ? kind::trade
+           : roll < 73 ? kind::cancel
+           : roll < 78 ? kind::cancel_all
+           : roll < 88 ? kind::withdraw
+           : roll < 90 ? kind::withdraw_all
+           : roll < 95 ? kind::match
+           : kind::expire;
+
+         // cancels and withdrawals need something to act on
+         if (k == kind::cancel && state.orders.empty()) {
+            k = kind::trade;
+         }
+         if (k == kind::withdraw && state.balances.empty()) {
+            k = kind::deposit;
+         }
+
+         switch (k) {
+            case kind::deposit: {
+               const symbol& sym = tokens[pick(tokens.size())];
+               return make_trx(trader, token_ser, name("eosio.token"), name("transfer"),
+                               mvo()("from", traders[trader])("to", exchange_account)("quantity", asset(int64_t(1 + pick(1000000)), sym))("memo", ""), slot);
+            }
+            case kind::deposit_trade: {
+               // an ask sells the deposited quote; a bid pays with deposited base
+               const std::string p = price.to_string();
+               const asset deposit = bids ? asset(price.get_amount() * int64_t(1 + pick(5)), m.base) : volume;
+               return make_trx(trader, token_ser, name("eosio.token"), name("transfer"),
+                               mvo()("from", traders[trader])("to", exchange_account)("quantity", deposit)
+                                    ("memo", "t:" + std::to_string(m.id) + (bids ? ":bid:" : ":ask:") + p.substr(0, p.find(' '))), slot);
+            }
+            case kind::trade: {
+               static const name tifs[] = { name(), name(), name(), name(), name(), name(), name("ioc"), name("fok"), name("post") };
+               const time_point_sec expiration = pick(10) == 0 ? time_point_sec(control->head_block_time()) + uint32_t(1 + pick(30)) : time_point_sec();
+               return make_trx(trader, exchange_ser, exchange_account, name("trade"),
+                               mvo()("trader", traders[trader])("market_id", m.id)("order_type", bids ? name("bid") : name("ask"))
+                                    ("price", price)("volume", volume)("max_fills", 1 + pick(20))
+                                    ("expiration", expiration)("time_in_force", tifs[pick(9)]), slot);
+            }
+            case kind::cancel: {
+               // mostly the owner cancelling, sometimes someone else trying to
+               const auto& o = state.orders[pick(state.orders.size())];
+               const uint32_t canceller = pick(10) == 0 ? trader : std::find(traders.begin(), traders.end(), std::get<0>(o)) - traders.begin();
+               return make_trx(canceller, exchange_ser, exchange_account, name("cancelorder"),
+                               mvo()("trader", traders[canceller])("market_id", std::get<1>(o))
+                                    ("side", std::get<2>(o) ? name("bid") : name("ask"))("order_id", std::get<3>(o)), slot);
+            }
+            case kind::cancel_all:
+               return make_trx(trader, exchange_ser, exchange_account, name("cancelall"),
+                               mvo()("trader", traders[trader])("market_id", pick(2) == 0 ? fc::variant() : fc::variant(m.id))("max", 1 + pick(10)), slot);
+            case kind::withdraw: {
+               const auto& b = state.balances[pick(state.balances.size())];
+               const uint32_t owner = std::find(traders.begin(), traders.end(), b.first) - traders.begin();
+               const asset amount(int64_t(1 + pick(uint64_t(std::max<int64_t>(b.second.get_amount(), 1)))), b.second.get_symbol());
+               return make_trx(owner, exchange_ser, exchange_account, name("withdraw"),
+                               mvo()("from", traders[owner])("quantity", extended_asset{amount, name("eosio.token")}), slot);
+            }
+            case kind::withdraw_all:
+               return make_trx(trader, exchange_ser, exchange_account, name("withdrawall"),
+                               mvo()("owner", traders[trader])("tokens", fc::variant()), slot);
+            case kind::match:
+               return make_trx(trader, exchange_ser, exchange_account, name("match"),
+                               mvo()("market_id", m.id)("max", 1 + pick(20)), slot);
+            default:
+               return make_trx(trader, exchange_ser, exchange_account, name("expire"), mvo()("max", 1 + pick(20)), slot);
+         }
+      }
+
+      /**
+       *  Checks that the exchange holds exactly what it owes in every token.
+       */
+      void check_conservation(const replay_state& state, uint32_t block) {
+         for (const auto& sym : tokens) {
+            auto itr = state.owed.find(sym.value());
+            INFO("block " << block << ", " << sym.to_string());
+            REQUIRE(held(sym) == (itr == state.owed.end() ? 0 : itr->second));
+         }
+      }
+
+      abi_serializer          exchange_ser;
+      abi_serializer          token_ser;
+      std::vector<symbol>     tokens;
+      std::vector<replay_market> markets;
+      std::vector<name>       traders;
+      std::vector<fc::crypto::private_key> keys;
+   };
+
+   /**
+    *  Assertions the random stream is expected to run into: spending more than a
+    *  balance, unfillable or crossing orders, cancelling orders that are gone or
+    *  belong to someone else, and empty withdrawals or matches.
+    */
+   static const char* const expected_rejections[] = {
+      "overdrawn balance",
+      "fill-or-kill order cannot be filled in full",
+      "post-only order would cross the book",
+      "order does not exist",
+      "order belongs to another trader",
+      "nothing to withdraw",
+      "nothing to match",
+      "deposit too small for an order at this price"
+   };
+
+   static bool is_expected_rejection(const fc::exception& e) {
+      const std::string msg = e.top_message();
+      return std::any_of(std::begin(expected_rejections), std::end(expected_rejections), [&](const char* expected) {
+         return msg == std::string("assertion failure with message: ") + expected;
+      });
+   }
+
+   static uint64_t env_or(const char* var, uint64_t fallback) {
+      const char* value = getenv(var);
+      return value ? strtoull(value, nullptr, 10) : fallback;
+   }
+
+} // namespace eosio_system
+
+
+TEST_CASE_FIXTURE(eosio_system::exchange_replay_tester, "seeded replay conserves every token") try {
+
+   using kind = eosio_system::exchange_replay_tester::kind;
+   static const char* kind_names[] = { "deposit", "deposit_trade", "trade", "cancel", "cancel_all",
+                                       "withdraw", "withdraw_all", "match", "expire" };
+
+   const uint64_t total = eosio_system::env_or("REPLAY_ACTIONS", 10000);
+   std::mt19937_64 rng(eosio_system::env_or("REPLAY_SEED", 1));
+
+   auto state = read_state();
+   check_conservation(state, 0);
+
+   uint64_t applied[size_t(kind::count)]  = {};
+   uint64_t rejected[size_t(kind::count)] = {};
+   uint64_t pushed = 0, blocks = 0, block_max = 0;
+   const auto start = std::chrono::steady_clock::now();
+
+   while (pushed < total) {
+      uint64_t in_block = 0;
+      for (uint32_t slot = 0; slot < block_actions && pushed < total; ++slot, ++pushed) {
+         kind k;
+         auto trx = next_action(rng, state, slot, k);
+         try {
+            push_transaction(trx);
+            ++applied[size_t(k)];
+            ++in_block;
+         } catch (const fc::exception& e) {
+            // a failed invariant of the contract is a bug, not a rejection
+            if (!eosio_system::is_expected_rejection(e)) {
+               FAIL("unexpected rejection of " << kind_names[size_t(k)] << " in block " << blocks + 1 << ": " << e.to_detail_string());
+            }
+            ++rejected[size_t(k)];
+         }
+      }
+      produce_block();
+      ++blocks;
+      block_max = std::max(block_max, in_block);
+
+      state = read_state();
+      check_conservation(state, blocks);
+   }
+
+   const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   uint64_t total_applied = 0;
+   std::string kinds;
+   for (size_t i = 0; i < size_t(kind::count); ++i) {
+      total_applied += applied[i];
+      kinds += std::string("\n  ") + kind_names[i] + ": " + std::to_string(applied[i]) + " applied, "
+             + std::to_string(rejected[i]) + " rejected";
+   }
+   MESSAGE("replayed " << pushed << " actions in " << blocks << " blocks (" << seconds << " s): "
+           << double(total_applied) / blocks << " applied actions per block, at most " << block_max
+           << ", " << state.orders.size() << " orders left on the books" << kinds);
+
+   CHECK(applied[size_t(kind::trade)] > 0);
+
+} FC_LOG_AND_RETHROW()
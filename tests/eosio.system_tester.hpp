@@ -3,6 +3,8 @@
 #include <eosio/testing/tester.hpp>
 #include <eosio/chain/abi_serializer.hpp>
 #include <eosio/chain/resource_limits.hpp>
+#include "action_profiler.hpp"
+#include "chain_snapshot.hpp"
 #include "contracts.hpp"
 #include "test_symbol.hpp"
 
@@ -58,10 +60,10 @@ public:
       set_code( config::system_account_name, contracts::system_wasm() );
       set_abi( config::system_account_name, contracts::system_abi().data() );
       if( call_init ) {
-         base_tester::push_action(config::system_account_name, N(init),
-                                               config::system_account_name,  mutable_variant_object()
-                                               ("version", 0)
-                                               ("core", CORE_SYM_STR)
+         push_action(config::system_account_name, N(init),
+                     config::system_account_name,  mutable_variant_object()
+                     ("version", 0)
+                     ("core", CORE_SYM_STR)
          );
       }
 
@@ -93,8 +95,17 @@ public:
    };
 
    eosio_system_tester( setup_level l = setup_level::full ) {
+      profile_transactions();
       if( l == setup_level::none ) return;
 
+      if( l == setup_level::full ) {
+         if( const auto* snapshot = chain_snapshots::find( "system", snapshot_inputs() ) ) {
+            restore_snapshot( *snapshot );
+            load_abis();
+            return;
+         }
+      }
+
       basic_setup();
       if( l == setup_level::minimal ) return;
 
@@ -105,10 +116,12 @@ public:
       if( l == setup_level::deploy_contract ) return;
 
       remaining_setup();
+      save_snapshot( "system", snapshot_inputs() );
    }
 
    template<typename Lambda>
    eosio_system_tester(Lambda setup) {
+      profile_transactions();
       setup(*this);
 
       basic_setup();
@@ -118,6 +131,64 @@ public:
    }
 
 
+   /**
+    *  Build inputs of the fully set up chain, see `chain_snapshots`
+    */
+   static const fc::sha256& snapshot_inputs() {
+      static const fc::sha256 inputs = chain_snapshots::digest( contracts::token_wasm(), contracts::token_abi(),
+                                                                contracts::system_wasm(), contracts::system_abi() );
+      return inputs;
+   }
+
+   /**
+    *  Replaces the chain, and the validating node's, with the state saved in `snapshot`.
+    */
+   void restore_snapshot( const std::string& snapshot ) {
+      close();
+      last_produced_block.clear();
+      fc::remove_all( cfg.blocks_dir );
+      fc::remove_all( cfg.state_dir );
+#ifndef NON_VALIDATING_TEST
+      validating_node.reset();
+      fc::remove_all( vcfg.blocks_dir );
+      fc::remove_all( vcfg.state_dir );
+      {
+         std::istringstream stream;
+         validating_node = std::make_unique<controller>( vcfg, make_protocol_feature_set() );
+         validating_node->add_indices();
+         validating_node->startup( []() { return false; }, chain_snapshots::reader( stream, snapshot ) );
+      }
+#endif
+      std::istringstream stream;
+      open( chain_snapshots::reader( stream, snapshot ) );
+      profile_transactions();
+   }
+
+   /**
+    *  Puts pending transactions into a block and saves the chain as the snapshot of `kind`.
+    *  Does nothing when snapshots are disabled, so such runs build every fixture exactly
+    *  as they did before snapshots existed.
+    */
+   void save_snapshot( const std::string& kind, const fc::sha256& inputs ) {
+      if( !chain_snapshots::enabled() )
+         return;
+
+      produce_block();
+      control->abort_block();
+      chain_snapshots::save( kind, inputs, *control );
+   }
+
+   /**
+    *  Reloads the ABIs of eosio.token and eosio from the chain, after a restore.
+    */
+   void load_abis() {
+      abi_def abi;
+      BOOST_REQUIRE_EQUAL( abi_serializer::to_abi( control->db().get<account_object,by_name>( N(eosio.token) ).abi, abi ), true );
+      token_abi_ser.set_abi( abi, abi_serializer_max_time );
+      BOOST_REQUIRE_EQUAL( abi_serializer::to_abi( control->db().get<account_object,by_name>( config::system_account_name ).abi, abi ), true );
+      abi_ser.set_abi( abi, abi_serializer_max_time );
+   }
+
    void create_accounts_with_resources( vector<account_name> accounts, account_name creator = config::system_account_name ) {
       for( auto a : accounts ) {
          create_account_with_resources( a, creator );
@@ -265,7 +336,83 @@ public:
          act.name = name;
          act.data = abi_ser.variant_to_binary( action_type_name, data, abi_serializer_max_time );
 
-         return base_tester::push_action( std::move(act), auth ? uint64_t(signer) : signer == N(bob111111111) ? N(alice1111111) : N(bob111111111) );
+         return push_action( std::move(act), auth ? uint64_t(signer) : signer == N(bob111111111) ? N(alice1111111) : N(bob111111111) );
+   }
+
+   /*
+    *  Profiled pushes: every transaction the chain applies is recorded by the
+    *  action_profiler, whichever push helper sent it. base_tester's push_action calls
+    *  its own push_transaction, so the push_action overloads are redone here on top of
+    *  this tester's push_transaction, which bills CPU objectively while
+    *  `objective_billing` is set, by default while profiling.
+    */
+
+   using base_tester::push_action;
+   using base_tester::push_transaction;
+
+   bool objective_billing = action_profiler::instance().enabled();
+
+   transaction_trace_ptr push_transaction( signed_transaction& trx, fc::time_point deadline = fc::time_point::maximum(),
+                                           uint32_t billed_cpu_time_us = DEFAULT_BILLED_CPU_TIME_US ) {
+      return base_tester::push_transaction( trx, deadline, objective_billing ? 0 : billed_cpu_time_us );
+   }
+
+   action_result push_action( action&& act, uint64_t authorizer ) {
+      signed_transaction trx;
+      if( authorizer ) {
+         act.authorization = vector<permission_level>{ { authorizer, config::active_name } };
+      }
+      trx.actions.emplace_back( std::move(act) );
+      set_transaction_headers( trx );
+      if( authorizer ) {
+         trx.sign( get_private_key( authorizer, "active" ), control->get_chain_id() );
+      }
+      try {
+         push_transaction( trx );
+      } catch( const fc::exception& ex ) {
+         edump( (ex.to_detail_string()) );
+         return error( ex.top_message() );
+      }
+      produce_block();
+      BOOST_REQUIRE_EQUAL( true, chain_has_transaction( trx.id() ) );
+      return success();
+   }
+
+   transaction_trace_ptr push_action( const account_name& code, const action_name& acttype, const vector<permission_level>& auths,
+                                      const variant_object& data, uint32_t expiration = DEFAULT_EXPIRATION_DELTA, uint32_t delay_sec = 0 ) {
+      signed_transaction trx;
+      trx.actions.emplace_back( get_action( code, acttype, auths, data ) );
+      set_transaction_headers( trx, expiration, delay_sec );
+      for( const auto& auth : auths ) {
+         trx.sign( get_private_key( auth.actor, auth.permission.to_string() ), control->get_chain_id() );
+      }
+      return push_transaction( trx );
+   }
+
+   transaction_trace_ptr push_action( const account_name& code, const action_name& acttype, const vector<account_name>& actors,
+                                      const variant_object& data, uint32_t expiration = DEFAULT_EXPIRATION_DELTA, uint32_t delay_sec = 0 ) {
+      vector<permission_level> auths;
+      for( const auto& actor : actors ) {
+         auths.push_back( permission_level{ actor, config::active_name } );
+      }
+      return push_action( code, acttype, auths, data, expiration, delay_sec );
+   }
+
+   transaction_trace_ptr push_action( const account_name& code, const action_name& acttype, const account_name& actor,
+                                      const variant_object& data, uint32_t expiration = DEFAULT_EXPIRATION_DELTA, uint32_t delay_sec = 0 ) {
+      return push_action( code, acttype, vector<permission_level>{ { actor, config::active_name } }, data, expiration, delay_sec );
+   }
+
+   /**
+    *  Hands the traces of the current chain to the action_profiler. Called again for
+    *  every chain a restore replaces it with.
+    */
+   void profile_transactions() {
+      if( !action_profiler::instance().enabled() )
+         return;
+      control->applied_transaction.connect( []( std::tuple<const transaction_trace_ptr&, const signed_transaction&> t ) {
+         action_profiler::instance().record( std::get<0>( t ) );
+      });
    }
 
    action_result stake( const account_name& from, const account_name& to, const asset& net, const asset& cpu ) {
@@ -345,7 +492,7 @@ public:
    }
 
    asset get_buyrex_result( const account_name& from, const asset& amount ) {
-      auto trace = base_tester::push_action( config::system_account_name, N(buyrex), from, mvo()("from", from)("amount", amount) );
+      auto trace = push_action( config::system_account_name, N(buyrex), from, mvo()("from", from)("amount", amount) );
       asset rex_received;
       for ( size_t i = 0; i < trace->action_traces.size(); ++i ) {
          if ( trace->action_traces[i].act.name == N(buyresult) ) {
@@ -368,11 +515,11 @@ public:
    }
 
    asset get_unstaketorex_result( const account_name& owner, const account_name& receiver, const asset& from_net, const asset& from_cpu ) {
-      auto trace = base_tester::push_action( config::system_account_name, N(unstaketorex), owner, mvo()
-                                             ("owner", owner)
-                                             ("receiver", receiver)
-                                             ("from_net", from_net)
-                                             ("from_cpu", from_cpu)
+      auto trace = push_action( config::system_account_name, N(unstaketorex), owner, mvo()
+                                ("owner", owner)
+                                ("receiver", receiver)
+                                ("from_net", from_net)
+                                ("from_cpu", from_cpu)
       );
       asset rex_received;
       for ( size_t i = 0; i < trace->action_traces.size(); ++i ) {
@@ -394,7 +541,7 @@ public:
    }
 
    asset get_sellrex_result( const account_name& from, const asset& rex ) {
-      auto trace = base_tester::push_action( config::system_account_name, N(sellrex), from, mvo()("from", from)("rex", rex) );
+      auto trace = push_action( config::system_account_name, N(sellrex), from, mvo()("from", from)("rex", rex) );
       asset proceeds;
       for ( size_t i = 0; i < trace->action_traces.size(); ++i ) {
          if ( trace->action_traces[i].act.name == N(sellresult) ) {
@@ -445,11 +592,11 @@ public:
 
    asset _get_rentrex_result( const account_name& from, const account_name& receiver, const asset& payment, bool cpu ) {
       const name act = cpu ? N(rentcpu) : N(rentnet);
-      auto trace = base_tester::push_action( config::system_account_name, act, from, mvo()
-                                             ("from",         from)
-                                             ("receiver",     receiver)
-                                             ("loan_payment", payment)
-                                             ("loan_fund",    core_sym::from_string("0.0000") )
+      auto trace = push_action( config::system_account_name, act, from, mvo()
+                                ("from",         from)
+                                ("receiver",     receiver)
+                                ("loan_payment", payment)
+                                ("loan_fund",    core_sym::from_string("0.0000") )
       );
 
       asset rented_tokens = core_sym::from_string("0.0000");
@@ -745,24 +892,24 @@ public:
          ("issuer",       manager )
          ("maximum_supply", maxsupply );
 
-      base_tester::push_action(contract, N(create), contract, act );
+      push_action(contract, N(create), contract, act );
    }
 
    void issue( const asset& amount, const name& manager = config::system_account_name ) {
-      base_tester::push_action( N(eosio.token), N(issue), manager, mutable_variant_object()
-                                ("to",       manager )
-                                ("quantity", amount )
-                                ("memo",     "")
-                                );
+      push_action( N(eosio.token), N(issue), manager, mutable_variant_object()
+                   ("to",       manager )
+                   ("quantity", amount )
+                   ("memo",     "")
+                   );
    }
 
    void transfer( const name& from, const name& to, const asset& amount, const name& manager = config::system_account_name ) {
-      base_tester::push_action( N(eosio.token), N(transfer), manager, mutable_variant_object()
-                                ("from",    from)
-                                ("to",      to )
-                                ("quantity", amount)
-                                ("memo", "")
-                                );
+      push_action( N(eosio.token), N(transfer), manager, mutable_variant_object()
+                   ("from",    from)
+                   ("to",      to )
+                   ("quantity", amount)
+                   ("memo", "")
+                   );
    }
 
    void issue_and_transfer( const name& to, const asset& amount, const name& manager = config::system_account_name ) {
@@ -843,10 +990,10 @@ public:
          BOOST_REQUIRE_EQUAL( success(), buyram( "eosio", "eosio.msig", core_sym::from_string("5000.0000") ) );
          produce_block();
 
-         auto trace = base_tester::push_action(config::system_account_name, N(setpriv),
-                                               config::system_account_name,  mutable_variant_object()
-                                               ("account", "eosio.msig")
-                                               ("is_priv", 1)
+         auto trace = push_action(config::system_account_name, N(setpriv),
+                                  config::system_account_name,  mutable_variant_object()
+                                  ("account", "eosio.msig")
+                                  ("is_priv", 1)
          );
 
          set_code( N(eosio.msig), contracts::msig_wasm() );
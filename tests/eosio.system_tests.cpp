@@ -2409,7 +2409,7 @@ BOOST_FIXTURE_TEST_CASE(producers_upgrade_system_contract, eosio_system_tester)
          act.name = name;
          act.data = msig_abi_ser.variant_to_binary( action_type_name, data, abi_serializer_max_time );
 
-         return base_tester::push_action( std::move(act), auth ? uint64_t(signer) : signer == N(bob111111111) ? N(alice1111111) : N(bob111111111) );
+         return push_action( std::move(act), auth ? uint64_t(signer) : signer == N(bob111111111) ? N(alice1111111) : N(bob111111111) );
    };
    // test begins
    vector<permission_level> prod_perms;
@@ -3191,7 +3191,7 @@ BOOST_FIXTURE_TEST_CASE( setparams, eosio_system_tester ) try {
          act.name = name;
          act.data = msig_abi_ser.variant_to_binary( action_type_name, data, abi_serializer_max_time );
 
-         return base_tester::push_action( std::move(act), auth ? uint64_t(signer) : signer == N(bob111111111) ? N(alice1111111) : N(bob111111111) );
+         return push_action( std::move(act), auth ? uint64_t(signer) : signer == N(bob111111111) ? N(alice1111111) : N(bob111111111) );
    };
 
    // test begins
@@ -3381,9 +3381,9 @@ BOOST_FIXTURE_TEST_CASE( eosioram_ramusage, eosio_system_tester ) try {
    BOOST_REQUIRE_EQUAL( false, get_row_by_account( N(eosio.token), N(alice1111111), N(accounts), symbol{CORE_SYM}.to_symbol_code() ).empty() );
 
    //remove row
-   base_tester::push_action( N(eosio.token), N(close), N(alice1111111), mvo()
-                             ( "owner", "alice1111111" )
-                             ( "symbol", symbol{CORE_SYM} )
+   push_action( N(eosio.token), N(close), N(alice1111111), mvo()
+                ( "owner", "alice1111111" )
+                ( "symbol", symbol{CORE_SYM} )
    );
    BOOST_REQUIRE_EQUAL( true, get_row_by_account( N(eosio.token), N(alice1111111), N(accounts), symbol{CORE_SYM}.to_symbol_code() ).empty() );
 
@@ -3922,8 +3922,8 @@ BOOST_FIXTURE_TEST_CASE( buy_sell_claim_rex, eosio_system_tester ) try {
    BOOST_REQUIRE_EQUAL( wasm_assert_msg("rex loans are currently not available"),
                         rentcpu( frank, frank, core_sym::from_string("0.0001") ) );
    {
-      auto trace = base_tester::push_action( config::system_account_name, N(rexexec), frank,
-                                             mvo()("user", frank)("max", 2) );
+      auto trace = push_action( config::system_account_name, N(rexexec), frank,
+                                mvo()("user", frank)("max", 2) );
       auto output = get_rexorder_result( trace );
       BOOST_REQUIRE_EQUAL( output.size(),    1 );
       BOOST_REQUIRE_EQUAL( output[0].first,  bob );
@@ -3947,8 +3947,8 @@ BOOST_FIXTURE_TEST_CASE( buy_sell_claim_rex, eosio_system_tester ) try {
    }
 
    {
-      auto trace1 = base_tester::push_action( config::system_account_name, N(updaterex), bob, mvo()("owner", bob) );
-      auto trace2 = base_tester::push_action( config::system_account_name, N(updaterex), carol, mvo()("owner", carol) );
+      auto trace1 = push_action( config::system_account_name, N(updaterex), bob, mvo()("owner", bob) );
+      auto trace2 = push_action( config::system_account_name, N(updaterex), carol, mvo()("owner", carol) );
       BOOST_REQUIRE_EQUAL( 0,              get_rex_vote_stake( bob ).get_amount() );
       BOOST_REQUIRE_EQUAL( init_stake,     get_voter_info( bob )["staked"].as<int64_t>() );
       BOOST_REQUIRE_EQUAL( 0,              get_rex_vote_stake( carol ).get_amount() );